@@ -1,3 +1,14 @@
 require 'mkmf'
+have_header("sys/epoll.h")
+have_header("ruby/io.h")
+have_header("ruby/thread.h")
+have_header("ruby/encoding.h")
+have_func("rb_io_descriptor")
+have_func("rb_block_call")
+have_func("rb_set_errinfo")
+have_func("rb_hash_foreach")
+have_func("rb_sym2str")
+have_func("rb_str_subseq")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
 create_makefile("romp_helper")
 system("echo CFLAGS+=-g -Wall -O3 >> Makefile")
@@ -6,23 +6,65 @@
 // Ruby (see http://www.ruby-lang.org/en/LICENSE.txt).
 
 #include <ruby.h>
+#ifdef HAVE_RUBY_IO_H
+#include <ruby/io.h>
+#else
 #include <rubyio.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 // ---------------------------------------------------------------------------
 // Useful macros
 // ---------------------------------------------------------------------------
 
+// Compatibility with interpreters older than 1.8.6
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+#ifndef RARRAY_LEN
+#define RARRAY_LEN(a) (RARRAY(a)->len)
+#define RARRAY_PTR(a) (RARRAY(a)->ptr)
+#endif
+#ifndef RFLOAT_VALUE
+#define RFLOAT_VALUE(f) (RFLOAT(f)->value)
+#endif
+
+// Compatibility with interpreters older than 2.1
+#if defined(HAVE_RB_BLOCK_CALL) && !defined(RB_BLOCK_CALL_FUNC_ARGLIST)
+#define RB_BLOCK_CALL_FUNC_ARGLIST(yielded_arg, callback_arg) \
+    VALUE yielded_arg, VALUE callback_arg, int argc, VALUE * argv, VALUE blockarg
+#endif
+
+// When the interpreter can release its global lock (CRuby 2.0 and later),
+// socket I/O is done without it, so a connection that is waiting on the
+// network does not hold up the threads serving other connections.
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#define ROMP_RELEASE_GVL
+#endif
+
 // TODO: Are these portable?
 
 #define PUTSHORT(s, buf) \
     do { \
-        *buf = s >> 8; ++buf; \
-        *buf = s & 0xff; ++buf; \
+        *buf = (s) >> 8; ++buf; \
+        *buf = (s) & 0xff; ++buf; \
     } while(0)
 
 #define GETSHORT(s, buf) \
@@ -31,6 +73,20 @@
         s = (s << 8) | (unsigned char)*buf; ++buf; \
     } while(0)
 
+#define PUTLONG(l, buf) \
+    do { \
+        PUTSHORT(((l) >> 16), buf); \
+        PUTSHORT(((l) & 0xffff), buf); \
+    } while(0)
+
+#define GETLONG(l, buf) \
+    do { \
+        uint16_t hi_, lo_; \
+        GETSHORT(hi_, buf); \
+        GETSHORT(lo_, buf); \
+        l = ((uint32_t)hi_ << 16) | lo_; \
+    } while(0)
+
 // ---------------------------------------------------------------------------
 // Globals
 // ---------------------------------------------------------------------------
@@ -42,11 +98,17 @@ static VALUE rb_cSession = Qnil;
 static VALUE rb_cProxy_Object = Qnil;
 static VALUE rb_cServer = Qnil;
 static VALUE rb_cObject_Reference = Qnil;
+static VALUE rb_cCursor_Reference = Qnil;
+static VALUE rb_cReactor = Qnil;
+static VALUE rb_cFuture = Qnil;
+static VALUE rb_cHandle_Table = Qnil;
 static ID id_object_id;
 
 // objects/functions created elsewhere
 //
 static VALUE rb_mMarshal = Qnil;
+static VALUE rb_cWeak_Map = Qnil;    // nil if weak maps are not usable
+static VALUE rb_cEnumerator_Class = Qnil; // nil before Ruby 1.9
 
 static ID id_dump;
 static ID id_load;
@@ -60,8 +122,47 @@ static ID id_slice_bang;
 static ID id_print_exception;
 static ID id_lock;
 static ID id_unlock;
+static ID id_close;
+static ID id_wait;
+static ID id_broadcast;
+static ID id_push;
+static ID id_values;
+static ID id_retain;
+static ID id_release;
+static ID id_aref;
+static ID id_aset;
+static ID id_default;
+static ID id_default_proc;
+static ID id_create_cursor;
+static ID id_remote_enumerator;
+static ID id_park;
+
+static VALUE weak_map_probe(VALUE weak_map) {
+    return rb_funcall(weak_map, id_aset, 2, INT2FIX(0), rb_obj_alloc(rb_cObject));
+}
+
+// Proxy_Objects are cached in an ObjectSpace::WeakMap keyed by object id,
+// which only works if the map accepts Integer keys (since Ruby 2.7).
+static void init_weak_map(void) {
+    VALUE objspace = rb_const_get(rb_cObject, rb_intern("ObjectSpace"));
+    VALUE klass;
+    int status;
 
-static struct timeval zero_timeval;
+    if(!rb_const_defined(objspace, rb_intern("WeakMap"))) {
+        return;
+    }
+    klass = rb_const_get(objspace, rb_intern("WeakMap"));
+    rb_protect(weak_map_probe, rb_class_new_instance(0, 0, klass), &status);
+    if(status == 0) {
+        rb_cWeak_Map = klass;
+        rb_global_variable(&rb_cWeak_Map);
+    }
+#ifdef HAVE_RB_SET_ERRINFO
+    else {
+        rb_set_errinfo(Qnil);
+    }
+#endif
+}
 
 static void init_globals() {
     rb_mMarshal = rb_const_get(rb_cObject, rb_intern("Marshal"));
@@ -78,9 +179,27 @@ static void init_globals() {
     id_print_exception = rb_intern("print_exception");
     id_lock = rb_intern("lock");
     id_unlock = rb_intern("unlock");
+    id_close = rb_intern("close");
+    id_wait = rb_intern("wait");
+    id_broadcast = rb_intern("broadcast");
+    id_push = rb_intern("push");
+    id_values = rb_intern("values");
+    id_retain = rb_intern("retain");
+    id_release = rb_intern("release");
+    id_aref = rb_intern("[]");
+    id_aset = rb_intern("[]=");
+    id_default = rb_intern("default");
+    id_default_proc = rb_intern("default_proc");
+    id_create_cursor = rb_intern("create_cursor");
+    id_remote_enumerator = rb_intern("remote_enumerator");
+    id_park = rb_intern("park");
+
+    init_weak_map();
 
-    zero_timeval.tv_sec = 0;
-    zero_timeval.tv_usec = 0;
+    if(rb_const_defined(rb_cObject, rb_intern("Enumerator"))) {
+        rb_cEnumerator_Class = rb_const_get(rb_cObject, rb_intern("Enumerator"));
+        rb_global_variable(&rb_cEnumerator_Class);
+    }
 }
 
 // ---------------------------------------------------------------------------
@@ -90,103 +209,237 @@ static void init_globals() {
 // Forward declaration
 static VALUE msg_to_obj(VALUE message, VALUE session, VALUE mutex);
 
-#define WRITE_HELPER \
-    do { \
-        write_count = write(fd, buf, count); \
-        if(write_count < 0) { \
-            if(errno != EWOULDBLOCK) rb_sys_fail("write"); \
-        } else if(write_count == 0 && count != 0) { \
-            rb_raise(rb_eIOError, "disconnected"); \
-        } else { \
-            count -= write_count; \
-            buf += write_count; \
-            total += write_count; \
-        } \
-    } while(0)
+// The functions below that do the actual reads and writes may run without
+// the interpreter lock, so they must not touch any Ruby objects.  Instead of
+// raising, they record what happened in a ROMP_IO; the caller raises once it
+// holds the lock again.
+#define ROMP_IO_DISCONNECTED   (-1)
 
-#define READ_HELPER \
-    do { \
-        read_count = read(fd, buf, count); \
-        if(read_count < 0) { \
-            if(errno != EWOULDBLOCK) rb_sys_fail("read"); \
-        } else if(read_count == 0 && count != 0) { \
-            rb_raise(rb_eIOError, "disconnected"); \
-        } else { \
-            count -= read_count; \
-            buf += read_count; \
-            total += read_count; \
-        } \
-    } while(0)
+typedef struct {
+    int fd;
+    int nonblock;
+    struct iovec * iov;     // data left to write
+    int iovcnt;
+    char * buf;             // buffer to read into
+    size_t max;             // size of buf
+    size_t count;           // bytes we still need to transfer
+    size_t total;           // bytes transferred so far
+    int error;              // errno, ROMP_IO_DISCONNECTED, or 0
+} ROMP_IO;
 
-// Write to an fd and raise an exception if an error occurs
-static ssize_t ruby_write_throw(int fd, const void * buf, size_t count, int nonblock) {
-    int n;
-    size_t total = 0;
+// Return true if a read or write on io would block the whole interpreter.
+// With the interpreter lock released, blocking is harmless, but otherwise
+// we must not make a blocking call on a descriptor in blocking mode until
+// poll says it is ready.  (Unlike select(), poll works for descriptors at or
+// above FD_SETSIZE.)
+static int io_would_block(ROMP_IO * io, short events) {
+#ifdef ROMP_RELEASE_GVL
+    return 0;
+#else
+    struct pollfd pfd;
+
+    if(io->nonblock) {
+        return 0;
+    }
+    pfd.fd = io->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+#endif
+}
+
+// Called when a read or write returned EWOULDBLOCK.  With the interpreter
+// lock released, wait right here; otherwise report back to the caller,
+// which will wait in a way that lets other Ruby threads run.  Returns true
+// if the operation should be retried.
+static int io_wait(ROMP_IO * io, short events) {
+#ifdef ROMP_RELEASE_GVL
+    struct pollfd pfd;
+
+    pfd.fd = io->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, -1) == -1) {
+        io->error = errno;
+        return 0;
+    }
+    return 1;
+#else
+    io->error = EWOULDBLOCK;
+    return 0;
+#endif
+}
+
+// Write io->count bytes from io->iov.  After a partial write, the
+// fully-written buffers are skipped and the first partially-written buffer
+// is adjusted so the next writev picks up where this one left off.
+static void * io_writev(void * ptr) {
+    ROMP_IO * io = (ROMP_IO *)ptr;
     ssize_t write_count;
-    fd_set fds, error_fds;
 
-    if(!nonblock) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_ZERO(&error_fds);
-        FD_SET(fd, &error_fds);
-        n = select(fd + 1, 0, &fds, &fds, 0);
-        if(n > 0) {
-            WRITE_HELPER;
+    while(io->count > 0) {
+        if(io_would_block(io, POLLOUT)) {
+            io->error = EWOULDBLOCK;
+            break;
         }
-    } else {
-        WRITE_HELPER;
-    }
 
-    while(count > 0) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_ZERO(&error_fds);
-        FD_SET(fd, &error_fds);
-        n = rb_thread_select(fd + 1, 0, &fds, &fds, 0);
-        if(n == -1) {
-            if(errno == EWOULDBLOCK) continue;
-            rb_sys_fail("select");
+        write_count = writev(io->fd, io->iov, io->iovcnt);
+        if(write_count < 0) {
+            if(errno == EWOULDBLOCK && io_wait(io, POLLOUT)) continue;
+            if(errno != EWOULDBLOCK) io->error = errno;
+            break;
+        } else if(write_count == 0) {
+            io->error = ROMP_IO_DISCONNECTED;
+            break;
         }
-        WRITE_HELPER;
-    };
-    return total;
+
+        io->count -= write_count;
+        io->total += write_count;
+        while(io->iovcnt > 0 && (size_t)write_count >= io->iov->iov_len) {
+            write_count -= io->iov->iov_len;
+            ++io->iov;
+            --io->iovcnt;
+        }
+        if(io->iovcnt > 0) {
+            io->iov->iov_base = (char *)io->iov->iov_base + write_count;
+            io->iov->iov_len -= write_count;
+        }
+    }
+
+    return 0;
 }
 
-// Read from an fd and raise an exception if an error occurs
-static ssize_t ruby_read_throw(int fd, void * buf, size_t count, int nonblock) {
-    int n;
-    size_t total = 0;
+// Read at least io->count more bytes into io->buf.  Each read takes as much
+// as is available (up to io->max bytes in all), so the caller can buffer
+// ahead.
+static void * io_read(void * ptr) {
+    ROMP_IO * io = (ROMP_IO *)ptr;
     ssize_t read_count;
-    fd_set fds, error_fds;
 
-    if(!nonblock) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_ZERO(&error_fds);
-        FD_SET(fd, &error_fds);
-        n = select(fd + 1, &fds, 0, &error_fds, &zero_timeval);
-        if(n > 0) {
-            READ_HELPER;
+    while(io->count > 0) {
+        if(io_would_block(io, POLLIN)) {
+            io->error = EWOULDBLOCK;
+            break;
+        }
+
+        read_count = read(io->fd, io->buf + io->total, io->max - io->total);
+        if(read_count < 0) {
+            if(errno == EWOULDBLOCK && io_wait(io, POLLIN)) continue;
+            if(errno != EWOULDBLOCK) io->error = errno;
+            break;
+        } else if(read_count == 0) {
+            io->error = ROMP_IO_DISCONNECTED;
+            break;
         }
+
+        io->total += read_count;
+        io->count -= (size_t)read_count < io->count ? (size_t)read_count : io->count;
+    }
+
+    return 0;
+}
+
+#ifndef ROMP_RELEASE_GVL
+
+// Wait until fd is ready for events (POLLIN or POLLOUT), letting other Ruby
+// threads run in the meantime.
+static void ruby_wait_fd(int fd, short events) {
+    if(events & POLLIN) {
+        rb_thread_wait_fd(fd);
     } else {
-        READ_HELPER;
+        rb_thread_fd_writable(fd);
     }
+}
+
+#endif
+
+// Call func (one of the I/O functions above, or something built on them)
+// until io->count reaches zero, releasing the interpreter lock while it
+// runs if we can.  Raise an exception if an error occurs.
+static void ruby_run_io(
+        void * (*func)(void *),
+        ROMP_IO * io,
+        short events,
+        const char * syscall) {
 
-    while(count > 0) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_ZERO(&error_fds);
-        FD_SET(fd, &error_fds);
-        n = rb_thread_select(fd + 1, &fds, 0, &error_fds, 0);
-        if(n == -1) {
-            if(errno == EWOULDBLOCK) continue;
-            rb_sys_fail("select");
+    for(;;) {
+        io->error = 0;
+#ifdef ROMP_RELEASE_GVL
+        rb_thread_call_without_gvl(func, io, RUBY_UBF_IO, 0);
+#else
+        func(io);
+#endif
+
+        switch(io->error) {
+            case 0:
+                if(io->count == 0) return;
+                break;
+            case EINTR:
+                // Give Thread#raise, Thread#kill and signal handlers a
+                // chance to run before we try again.
+#ifdef ROMP_RELEASE_GVL
+                rb_thread_check_ints();
+#endif
+                continue;
+            case ROMP_IO_DISCONNECTED:
+                rb_raise(rb_eIOError, "disconnected");
+            default:
+                if(io->error != EWOULDBLOCK) {
+                    errno = io->error;
+                    rb_sys_fail(syscall);
+                }
         }
-        READ_HELPER;
-    };
 
-    return total;
+#ifndef ROMP_RELEASE_GVL
+        ruby_wait_fd(io->fd, events);
+#endif
+    }
+}
+
+// Write a vector of buffers to an fd and raise an exception if an error
+// occurs.  Partial writes are handled by advancing through iov, so the
+// caller's iovec array may be modified.
+static ssize_t ruby_writev_throw(int fd, struct iovec * iov, int iovcnt, int nonblock) {
+    ROMP_IO io;
+    int j;
+
+    memset(&io, 0, sizeof(io));
+    io.fd = fd;
+    io.nonblock = nonblock;
+    io.iov = iov;
+    io.iovcnt = iovcnt;
+    for(j = 0; j < iovcnt; ++j) {
+        io.count += iov[j].iov_len;
+    }
+
+    ruby_run_io(io_writev, &io, POLLOUT, "writev");
+    return io.total;
+}
+
+// Write to an fd and raise an exception if an error occurs
+static ssize_t ruby_write_throw(int fd, const void * buf, size_t count, int nonblock) {
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = count;
+    return ruby_writev_throw(fd, &iov, 1, nonblock);
+}
+
+// Read from an fd and raise an exception if an error occurs.  At least
+// count bytes are read; if more data is already available, up to max bytes
+// are read, so the caller can buffer ahead.
+static ssize_t ruby_read_throw(
+        int fd, void * buf, size_t count, size_t max, int nonblock) {
+    ROMP_IO io;
+
+    memset(&io, 0, sizeof(io));
+    io.fd = fd;
+    io.nonblock = nonblock;
+    io.buf = (char *)buf;
+    io.max = max;
+    io.count = count;
+
+    ruby_run_io(io_read, &io, POLLIN, "read");
+    return io.total;
 }
 
 // Return the message of an exception
@@ -216,8 +469,8 @@ static VALUE ruby_send(VALUE obj, VALUE msg) {
 }
 
 // Call "get_object" on a Ruby object
-static VALUE ruby_get_object(VALUE obj, VALUE object_id) {
-    return rb_funcall(obj, id_get_object, 1, INT2NUM(object_id));
+static VALUE ruby_get_object(VALUE obj, uint32_t object_id) {
+    return rb_funcall(obj, id_get_object, 1, UINT2NUM(object_id));
 }
 
 // Call slice! on a Ruby object
@@ -258,278 +511,3339 @@ static VALUE marshal_load(VALUE str) {
 }
 
 // ---------------------------------------------------------------------------
-// Session functions
+// Buffer functions
 // ---------------------------------------------------------------------------
 
-#define ROMP_REQUEST           0x1001
-#define ROMP_REQUEST_BLOCK     0x1002
-#define ROMP_ONEWAY            0x1003
-#define ROMP_ONEWAY_SYNC       0x1004
-#define ROMP_RETVAL            0x2001
-#define ROMP_EXCEPTION         0x2002
-#define ROMP_YIELD             0x2003
-#define ROMP_SYNC              0x4001
-#define ROMP_NULL_MSG          0x4002
-#define ROMP_MSG_START         0x4242
-#define ROMP_MAX_ID            (1<<16)
-#define ROMP_MAX_MSG_TYPE      (1<<16)
+// A growable buffer of plain C memory.  It grows geometrically, so a
+// buffer that is reused settles at a size that fits what it holds.
+typedef struct {
+    char * ptr;
+    size_t len, capacity;
+} ROMP_Buffer;
 
-#define ROMP_BUFFER_SIZE       16
+static void buffer_reserve(ROMP_Buffer * buf, size_t count) {
+    size_t capacity = buf->capacity ? buf->capacity : 256;
 
-typedef struct {
-    VALUE io_object;
-    int read_fd, write_fd;
-    char buf[ROMP_BUFFER_SIZE];
-    int nonblock;
-} ROMP_Session;
+    if(buf->len + count <= buf->capacity) {
+        return;
+    }
+    while(capacity < buf->len + count) {
+        capacity *= 2;
+    }
+    REALLOC_N(buf->ptr, char, capacity);
+    buf->capacity = capacity;
+}
 
-typedef uint16_t MESSAGE_TYPE_T;
-typedef uint16_t OBJECT_ID_T;
+static void buffer_cat(ROMP_Buffer * buf, const void * ptr, size_t count) {
+    buffer_reserve(buf, count);
+    memcpy(buf->ptr + buf->len, ptr, count);
+    buf->len += count;
+}
+
+// Shrink (or free, if capacity is 0) the memory held by buf.
+static void buffer_shrink(ROMP_Buffer * buf, size_t capacity) {
+    if(capacity >= buf->capacity) {
+        return;
+    }
+    if(capacity == 0) {
+        xfree(buf->ptr);
+        buf->ptr = 0;
+    } else {
+        REALLOC_N(buf->ptr, char, capacity);
+    }
+    buf->capacity = capacity;
+    if(buf->len > capacity) {
+        buf->len = capacity;
+    }
+}
 
-// A ROMP message is broken into 3 components (see romp.rb for more details)
+#define ROMP_FRAME_LIMIT       (1<<20)  // default cap on a frame buffer
+#define ROMP_FRAME_MIN         4096     // frame buffers never shrink below this
+#define ROMP_FRAME_TRIM        1024     // frames between size checks
+#define ROMP_FRAME_IDLE        1000     // ms a quiet session keeps its frame buffers
+
+// Each session has two frame buffers: one that outgoing messages are
+// encoded in and one that incoming messages too large for the read-ahead
+// buffer are read into, so that steady traffic does not allocate.  A
+// frame buffer never keeps more than the session's frame limit once a
+// frame is done with it, and every ROMP_FRAME_TRIM frames it gives back
+// what it has not needed since the last time it checked.  A session that
+// goes quiet for about ROMP_FRAME_IDLE milliseconds gives back all but
+// ROMP_FRAME_MIN bytes of each (see frame_idle).  Every message counts as
+// a frame, whether it went through the frame buffer or not, so the high
+// water marks say how big the messages have been, to help pick a limit.
+//
+// Each frame buffer belongs to whichever thread is sending (or reading)
+// on the session, so it is only ever resized by that thread, or by one
+// that has made sure nobody is sending (or reading).
 typedef struct {
-    MESSAGE_TYPE_T message_type;
-    OBJECT_ID_T object_id;
-    VALUE message_obj;
-} ROMP_Message;
+    ROMP_Buffer buf;
+    size_t peak;                // largest frame since the last size check
+    size_t high_water;          // largest frame ever
+    unsigned long frames;       // frames since the last size check
+    unsigned long oversize;     // frames larger than the limit
+    int used;                   // true if a frame went through since frame_idle
+} ROMP_Frame_Buffer;
 
-// Send a message to the server with data data and length len.
-static void send_message_helper(
-        ROMP_Session * session,
-        char * data,
-        size_t len,
-        MESSAGE_TYPE_T message_type,
-        OBJECT_ID_T object_id) {
+// Give back all but ROMP_FRAME_MIN bytes of frame buffer fb.
+static void frame_trim(ROMP_Frame_Buffer * fb) {
+    buffer_shrink(&fb->buf, ROMP_FRAME_MIN);
+    fb->peak = 0;
+    fb->frames = 0;
+}
 
-    char * buf = session->buf;
+// Note that frame buffer fb has been used for a frame of len bytes, and
+// trim it back if it has grown past limit or has not been needed at its
+// current size for a while.
+static void frame_done(ROMP_Frame_Buffer * fb, size_t len, size_t limit) {
+    size_t capacity;
 
-    PUTSHORT(ROMP_MSG_START,    buf);
-    PUTSHORT(len,               buf);
-    PUTSHORT(message_type,      buf);
-    PUTSHORT(object_id,         buf);
+    if(len > fb->peak) {
+        fb->peak = len;
+    }
+    if(len > fb->high_water) {
+        fb->high_water = len;
+    }
+    if(len > limit) {
+        ++fb->oversize;
+    }
+    fb->buf.len = 0;
+    fb->used = 1;
 
-    ruby_write_throw(session->write_fd, session->buf, ROMP_BUFFER_SIZE, session->nonblock);
-    ruby_write_throw(session->write_fd, data, len, session->nonblock);
-}
+    if(fb->buf.capacity > limit) {
+        buffer_shrink(&fb->buf, limit);
+    }
 
-// Send a message to the server with the data in message.
-static void send_message(ROMP_Session * session, ROMP_Message * message) {
-    VALUE data;
-    struct RString * data_str;
+    if(++fb->frames < ROMP_FRAME_TRIM) {
+        return;
+    }
 
-    data = marshal_dump(message->message_obj);
-    data_str = RSTRING(data);
-    send_message_helper(
-        session,
-        data_str->ptr,
-        data_str->len,
-        message->message_type,
-        message->object_id);
+    capacity = ROMP_FRAME_MIN;
+    while(capacity < fb->peak && capacity < limit) {
+        capacity *= 2;
+    }
+    buffer_shrink(&fb->buf, capacity);
+    fb->peak = 0;
+    fb->frames = 0;
 }
 
-// Send a null message to the server (no data, data len = 0)
-static void send_null_message(ROMP_Session * session) {
-    send_message_helper(session, "", 0, ROMP_NULL_MSG, 0);
+// Called about every ROMP_FRAME_IDLE milliseconds for a session that may
+// have gone quiet: trim frame buffer fb if no frame has gone through it
+// since the last call.
+static void frame_idle(ROMP_Frame_Buffer * fb) {
+    if(!fb->used) {
+        frame_trim(fb);
+    }
+    fb->used = 0;
 }
 
-// Receive a message from the server
-static void get_message(ROMP_Session * session, ROMP_Message * message) {
-    uint16_t magic          = 0;
-    uint16_t data_len       = 0;
-    char * buf              = 0;
-    // struct RString message_string;
-    VALUE ruby_str;
+// ---------------------------------------------------------------------------
+// Native encoding functions
+// ---------------------------------------------------------------------------
 
-    do {
-        buf = session->buf;
-        
-        ruby_read_throw(session->read_fd, buf, ROMP_BUFFER_SIZE, session->nonblock);
+// From protocol version 4 on, messages made up only of nil, true, false,
+// Integers that fit in a Fixnum, Floats, Strings, Symbols, Arrays and
+// Hashes are encoded here instead of with Marshal, which is much faster for
+// the small messages most calls send.  Each value is a tag byte followed by
+// its contents; lengths and Integers are varints (7 bits to a byte, low
+// bits first, Integers zigzagged so small negative numbers stay short).
+// Anything else (including subclasses of the core classes, Hashes with a
+// default, and objects with instance variables) sends the whole message
+// with Marshal.  Unlike Marshal, an object that appears twice in a message
+// arrives as two copies.
+//
+// The bytes of large Strings are not copied into the encoded data: they are
+// written to the socket straight from the String (see Message_Data).  The
+// receiver reads them straight from the socket into Strings of their own,
+// or, for a message too large for the session's input frame buffer, gets
+// them as Strings that share the buffer the whole message was read into
+// (see get_message).
+#define ROMP_NATIVE_NIL        'n'
+#define ROMP_NATIVE_TRUE       'T'
+#define ROMP_NATIVE_FALSE      'F'
+#define ROMP_NATIVE_INTEGER    'i'
+#define ROMP_NATIVE_FLOAT      'f'
+#define ROMP_NATIVE_STRING     's'      // binary (ASCII-8BIT) string
+#define ROMP_NATIVE_UTF8       'u'
+#define ROMP_NATIVE_ASCII      'a'      // US-ASCII string
+#define ROMP_NATIVE_SYMBOL     ':'
+#define ROMP_NATIVE_ARRAY      '['
+#define ROMP_NATIVE_HASH       '{'
+#define ROMP_NATIVE_MAX_DEPTH  64
+#define ROMP_RAW_MIN           4096     // smallest String sent in place
+#define ROMP_RAW_MAX           16       // most Strings sent in place per message
+#define ROMP_NATIVE_CHUNK      8192     // most read at a time while decoding
 
-        GETSHORT(magic,                 buf);
-        GETSHORT(data_len,              buf);
-        GETSHORT(message->message_type, buf);
-        GETSHORT(message->object_id,    buf);
-    } while(magic != ROMP_MSG_START);
+// The natively encoded data for a message: buf, with the bytes of each
+// String in raw inserted at its offset.
+typedef struct {
+    size_t offset;
+    VALUE str;
+} Raw_String;
 
-    buf = ALLOCA_N(char, data_len);
-    ruby_read_throw(session->read_fd, buf, data_len, session->nonblock);
-    ruby_str = rb_str_new(buf, data_len);
+typedef struct {
+    ROMP_Buffer * buf;
+    int num_raw;
+    Raw_String raw[ROMP_RAW_MAX];
+} Message_Data;
 
-    if(message->message_type != ROMP_NULL_MSG) {
-        message->message_obj = marshal_load(ruby_str);
-    } else {
-        message->message_obj = Qnil;
-    }
-}
+static void native_put_varint(ROMP_Buffer * buf, uint64_t n) {
+    char bytes[10];
+    size_t len = 0;
 
-// Ideally, this function should return true if the server has disconnected,
-// but currently always returns false.  The server thread will still exit
-// when the client has disconnected, but currently does so via an exception.
-static int session_finished(ROMP_Session * session) {
-    // TODO: Detect a disconnection
-    return 0;
+    while(n >= 0x80) {
+        bytes[len++] = (char)((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    bytes[len++] = (char)n;
+    buffer_cat(buf, bytes, len);
 }
 
-// Send a sync message to the server.
-static void send_sync(ROMP_Session * session) {
-    ROMP_Message message = { ROMP_SYNC, 0, Qnil };
-    send_message(session, &message);
+static void native_put_bytes(ROMP_Buffer * buf, char tag, const char * ptr, size_t len) {
+    buffer_cat(buf, &tag, 1);
+    native_put_varint(buf, len);
+    buffer_cat(buf, ptr, len);
 }
 
-// Wait for a sync response from the server.  Ignore any messages that are
-// received while waiting for the response.
-static void wait_sync(ROMP_Session * session) {
-    ROMP_Message message;
+// Add a String to the data, leaving large ones where they are.  A String
+// that appears more than once is only left in place the first time, since
+// it is locked while it is being written.
+static void native_put_string(Message_Data * data, char tag, VALUE str) {
+    int j;
 
-    // sleep(1);
-    get_message(session, &message);
-    if(   message.message_type != ROMP_SYNC
-       && message.object_id != 1
-       && message.message_obj != Qnil) {
-        rb_raise(rb_eRuntimeError, "ROMP synchronization failed");
+    if(   RSTRING_LEN(str) < ROMP_RAW_MIN
+       || data->num_raw == ROMP_RAW_MAX) {
+        native_put_bytes(data->buf, tag, RSTRING_PTR(str), RSTRING_LEN(str));
+        return;
     }
+    for(j = 0; j < data->num_raw; ++j) {
+        if(data->raw[j].str == str) {
+            native_put_bytes(data->buf, tag, RSTRING_PTR(str), RSTRING_LEN(str));
+            return;
+        }
+    }
+
+    buffer_cat(data->buf, &tag, 1);
+    native_put_varint(data->buf, RSTRING_LEN(str));
+    data->raw[data->num_raw].offset = data->buf->len;
+    data->raw[data->num_raw].str = str;
+    ++data->num_raw;
 }
 
-// Send a reply to a sync request.
-static void reply_sync(ROMP_Session * session, int value) {
-    if(value == 0) {
-        ROMP_Message message = { ROMP_SYNC, 1, Qnil };
-        send_message(session, &message);
-    }
+// Objects with instance variables (or, before 1.9, a string's encoding)
+// need Marshal to come through intact.
+static int native_plain(VALUE obj, VALUE klass) {
+    return CLASS_OF(obj) == klass && !FL_TEST(obj, FL_EXIVAR);
 }
 
-// ----------------------------------------------------------------------------
-// Server functions
-// ----------------------------------------------------------------------------
+static int native_encode_value(Message_Data * data, VALUE obj, int depth);
+
+#ifdef HAVE_RB_HASH_FOREACH
 
-// We use this structure to pass data to our exception handler.  This is done
-// by casting a pointer to a Ruby VALUE... not 100% kosher, but it should work.
 typedef struct {
-    ROMP_Session * session;
-    ROMP_Message * message;
-    VALUE obj;
-    int debug;
-} Server_Info;
+    Message_Data * data;
+    int depth;
+    int ok;
+} Native_Hash;
 
-// Make a method call into a Ruby object.
-static VALUE server_funcall(VALUE ruby_server_info) {
-    Server_Info * server_info = (Server_Info *)(ruby_server_info);
-    return ruby_send(server_info->obj, server_info->message->message_obj);
+static int native_encode_pair(VALUE key, VALUE value, VALUE ruby_native_hash) {
+    Native_Hash * native_hash = (Native_Hash *)(ruby_native_hash);
+
+    if(   !native_encode_value(native_hash->data, key, native_hash->depth)
+       || !native_encode_value(native_hash->data, value, native_hash->depth)) {
+        native_hash->ok = 0;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
 }
 
-// Send a yield message to the client, indicating that it should call
-// Kernel#yield with the message that is sent.
-static VALUE server_send_yield(VALUE retval, VALUE ruby_server_info) {
-    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+#endif
 
-    server_info->message->message_type = ROMP_YIELD;
-    server_info->message->object_id = 0;
-    server_info->message->message_obj = retval;
-    send_message(server_info->session, server_info->message);
+// Append the encoding of obj to data.  Returns false if obj (or something
+// in it) cannot be encoded natively; data is then left in an unknown state.
+static int native_encode_value(Message_Data * data, VALUE obj, int depth) {
+    ROMP_Buffer * buf = data->buf;
+    char tag;
+    double d;
+    uint64_t bits;
+    char bytes[8];
+    long j;
+    VALUE name;
 
-    return Qnil;
-}
+    if(depth > ROMP_NATIVE_MAX_DEPTH) {
+        return 0;
+    }
 
-// Send a return value to the client, indicating that it should return
-// the message to the caller.
-static VALUE server_send_retval(VALUE retval, VALUE ruby_server_info) {
-    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    switch(TYPE(obj)) {
+        case T_NIL:
+            tag = ROMP_NATIVE_NIL;
+            buffer_cat(buf, &tag, 1);
+            return 1;
 
-    server_info->message->message_type = ROMP_RETVAL;
-    server_info->message->object_id = 0;
-    server_info->message->message_obj = retval;
-    send_message(server_info->session, server_info->message);
+        case T_TRUE:
+            tag = ROMP_NATIVE_TRUE;
+            buffer_cat(buf, &tag, 1);
+            return 1;
 
-    return Qnil;
-}
+        case T_FALSE:
+            tag = ROMP_NATIVE_FALSE;
+            buffer_cat(buf, &tag, 1);
+            return 1;
 
-// Send an exception the client, indicating that it should raise an exception.
-static VALUE server_exception(VALUE ruby_server_info, VALUE exc) {
-    Server_Info * server_info = (Server_Info *)(ruby_server_info);
-    VALUE caller = ruby_caller();
-    VALUE bt = ruby_exc_backtrace(exc);
+        case T_FIXNUM:
+            tag = ROMP_NATIVE_INTEGER;
+            buffer_cat(buf, &tag, 1);
+            j = FIX2LONG(obj);
+            native_put_varint(
+                buf,
+                ((uint64_t)j << 1) ^ (uint64_t)(j < 0 ? -1 : 0));
+            return 1;
 
-    server_info->message->message_type = ROMP_EXCEPTION;
-    server_info->message->object_id = 0;
-    server_info->message->message_obj = exc;
+        case T_FLOAT:
+            tag = ROMP_NATIVE_FLOAT;
+            buffer_cat(buf, &tag, 1);
+            d = RFLOAT_VALUE(obj);
+            memcpy(&bits, &d, sizeof(bits));
+            for(j = 7; j >= 0; --j) {
+                bytes[j] = (char)(bits & 0xff);
+                bits >>= 8;
+            }
+            buffer_cat(buf, bytes, 8);
+            return 1;
 
-    // Get rid of extraneous caller information to make debugging easier.
-    ruby_slice_bang(bt, RARRAY(bt)->len - RARRAY(caller)->len - 1, -1);
+        case T_STRING:
+            if(!native_plain(obj, rb_cString)) {
+                return 0;
+            }
+#ifdef HAVE_RUBY_ENCODING_H
+            if(rb_enc_get(obj) == rb_utf8_encoding()) {
+                tag = ROMP_NATIVE_UTF8;
+            } else if(rb_enc_get(obj) == rb_usascii_encoding()) {
+                tag = ROMP_NATIVE_ASCII;
+            } else if(rb_enc_get(obj) == rb_ascii8bit_encoding()) {
+                tag = ROMP_NATIVE_STRING;
+            } else {
+                return 0;
+            }
+#else
+            tag = ROMP_NATIVE_STRING;
+#endif
+            native_put_string(data, tag, obj);
+            return 1;
 
-    // If debugging is enabled, then print an exception.
-    if(server_info->debug) {
-        ruby_print_exception(exc);
-    }
+        case T_SYMBOL:
+#ifdef HAVE_RB_SYM2STR
+            name = rb_sym2str(obj);
+#else
+            name = rb_str_new2(rb_id2name(SYM2ID(obj)));
+#endif
+            for(j = 0; j < RSTRING_LEN(name); ++j) {
+                if((unsigned char)RSTRING_PTR(name)[j] >= 0x80) {
+                    return 0;
+                }
+            }
+            native_put_bytes(
+                buf,
+                ROMP_NATIVE_SYMBOL,
+                RSTRING_PTR(name),
+                RSTRING_LEN(name));
+            return 1;
+
+        case T_ARRAY:
+            if(!native_plain(obj, rb_cArray)) {
+                return 0;
+            }
+            tag = ROMP_NATIVE_ARRAY;
+            buffer_cat(buf, &tag, 1);
+            native_put_varint(buf, RARRAY_LEN(obj));
+            for(j = 0; j < RARRAY_LEN(obj); ++j) {
+                if(!native_encode_value(data, RARRAY_PTR(obj)[j], depth + 1)) {
+                    return 0;
+                }
+            }
+            return 1;
 
-    send_message(server_info->session, server_info->message);
+#ifdef HAVE_RB_HASH_FOREACH
+        case T_HASH: {
+            Native_Hash native_hash;
 
-    return Qnil;
+            if(   !native_plain(obj, rb_cHash)
+               || !NIL_P(rb_funcall(obj, id_default, 0))
+               || !NIL_P(rb_funcall(obj, id_default_proc, 0))) {
+                return 0;
+            }
+            tag = ROMP_NATIVE_HASH;
+            buffer_cat(buf, &tag, 1);
+            native_put_varint(buf, RHASH_SIZE(obj));
+            native_hash.data = data;
+            native_hash.depth = depth + 1;
+            native_hash.ok = 1;
+            rb_hash_foreach(obj, native_encode_pair, (VALUE)(&native_hash));
+            return native_hash.ok;
+        }
+#endif
+
+        default:
+            return 0;
+    }
 }
 
-// Proces a request from the client and send an appropriate reply.
-static VALUE server_reply(VALUE ruby_server_info) {
-    Server_Info * server_info = (Server_Info *)(ruby_server_info);
-    VALUE retval;
-    int status;
+// Encode obj natively into buf, leaving the first start bytes free (for
+// the message header).  Returns false if it cannot be.
+static int native_encode(Message_Data * data, ROMP_Buffer * buf, size_t start, VALUE obj) {
+    buf->len = 0;
+    buffer_reserve(buf, start);
+    buf->len = start;
+    data->buf = buf;
+    data->num_raw = 0;
+    return native_encode_value(data, obj, 0);
+}
 
-    server_info->obj = ruby_get_object(
-        server_info->obj,
-        server_info->message->object_id);
+// Point iov at the pieces of data, in order and starting from the front
+// of the buffer, and return how many there are (at most 2 * ROMP_RAW_MAX
+// + 1).  *len is set to the total length.
+static int message_data_iov(const Message_Data * data, struct iovec * iov, size_t * len) {
+    size_t offset = 0;
+    int iovcnt = 0;
+    int j;
 
-    // TODO: The client should be able to pass a callback object to the server;
-    // msg_to_obj can create a Proxy_Object, but it needs a session to make
-    // calls over.
+    *len = 0;
+    for(j = 0; j <= data->num_raw; ++j) {
+        size_t end = j < data->num_raw ? data->raw[j].offset : data->buf->len;
+        iov[iovcnt].iov_base = data->buf->ptr + offset;
+        iov[iovcnt].iov_len = end - offset;
+        *len += iov[iovcnt++].iov_len;
+        offset = end;
+        if(j < data->num_raw) {
+            iov[iovcnt].iov_base = RSTRING_PTR(data->raw[j].str);
+            iov[iovcnt].iov_len = RSTRING_LEN(data->raw[j].str);
+            *len += iov[iovcnt++].iov_len;
+        }
+    }
+    return iovcnt;
+}
 
-    // Perform the appropriate action based on message type.
-    switch(server_info->message->message_type) {
-        case ROMP_ONEWAY_SYNC:
-            send_null_message(server_info->session);
-            // fallthrough
- 
-        case ROMP_ONEWAY:
-            rb_protect(server_funcall, ruby_server_info, &status);
-            return Qnil;
+// Where native_decode_value is in the data being decoded.  If the data is
+// in a String (source), large Strings are made from it without copying.
+// The data may also still be arriving: only the bytes up to end are in
+// memory, and the rest, up to limit, are read from fd as they are needed,
+// except that large Strings are read straight into Strings of their own.
+typedef struct {
+    VALUE source;
+    const unsigned char * start;
+    const unsigned char * ptr;
+    const unsigned char * end;
+    const unsigned char * limit;
+    int fd;                 // -1 if the data is all in memory
+    int nonblock;
+} Native_Decoder;
 
-        case ROMP_REQUEST:
-            retval = ruby_send(
-                server_info->obj,
-                server_info->message->message_obj);
-            break;
+static void native_bad_data(void) {
+    rb_raise(rb_eArgError, "Bad natively encoded message");
+}
+
+// Make sure the next count bytes of the data are in memory, reading more
+// of them in if need be.  Reads stop short of a large String's bytes where
+// they can, so few of them are read into the buffer.
+static void native_need(Native_Decoder * decoder, size_t count) {
+    size_t have = decoder->end - decoder->ptr;
+    size_t max;
+
+    if(have >= count) {
+        return;
+    }
+    if((size_t)(decoder->limit - decoder->ptr) < count || decoder->fd < 0) {
+        native_bad_data();
+    }
+    max = decoder->limit - decoder->end;
+    if(max > ROMP_NATIVE_CHUNK && count - have <= ROMP_NATIVE_CHUNK) {
+        max = ROMP_NATIVE_CHUNK;
+    }
+    decoder->end += ruby_read_throw(
+        decoder->fd,
+        (char *)decoder->end,
+        count - have,
+        max,
+        decoder->nonblock);
+}
+
+// Make a String of the next len bytes of the data, which are large enough
+// not to be copied if that can be helped.
+static VALUE native_get_raw(Native_Decoder * decoder, long len) {
+    VALUE obj;
+    size_t have = decoder->end - decoder->ptr;
+
+    if(!NIL_P(decoder->source)) {
+#ifdef HAVE_RB_STR_SUBSEQ
+        obj = rb_str_subseq(
+            decoder->source, decoder->ptr - decoder->start, len);
+#else
+        obj = rb_str_substr(
+            decoder->source, decoder->ptr - decoder->start, len);
+#endif
+    } else if(decoder->fd < 0 || have >= (size_t)len) {
+        obj = rb_str_new((const char *)decoder->ptr, len);
+    } else {
+        obj = rb_str_new(0, len);
+        memcpy(RSTRING_PTR(obj), decoder->ptr, have);
+        ruby_read_throw(
+            decoder->fd,
+            RSTRING_PTR(obj) + have,
+            len - have,
+            len - have,
+            decoder->nonblock);
+        decoder->end = decoder->ptr + len;
+    }
+    decoder->ptr += len;
+    return obj;
+}
+
+static uint64_t native_get_varint(Native_Decoder * decoder) {
+    uint64_t n = 0;
+    int shift;
+
+    for(shift = 0; shift < 64; shift += 7) {
+        if(decoder->ptr == decoder->limit) {
+            break;
+        }
+        native_need(decoder, 1);
+        n |= (uint64_t)(*decoder->ptr & 0x7f) << shift;
+        if(!(*decoder->ptr++ & 0x80)) {
+            return n;
+        }
+    }
+    native_bad_data();
+    return 0;
+}
+
+// Read a length, making sure at least that many bytes (or, for Arrays and
+// Hashes, values of at least a byte each) are left.
+static long native_get_length(Native_Decoder * decoder) {
+    uint64_t len = native_get_varint(decoder);
+    if(len > (uint64_t)(decoder->limit - decoder->ptr)) {
+        native_bad_data();
+    }
+    return (long)len;
+}
+
+static VALUE native_decode_value(Native_Decoder * decoder, int depth) {
+    unsigned char tag;
+    uint64_t n;
+    double d;
+    long len, j;
+    VALUE obj, key;
+
+    if(depth > ROMP_NATIVE_MAX_DEPTH) {
+        native_bad_data();
+    }
+    native_need(decoder, 1);
+    tag = *decoder->ptr++;
+
+    switch(tag) {
+        case ROMP_NATIVE_NIL:
+            return Qnil;
+
+        case ROMP_NATIVE_TRUE:
+            return Qtrue;
+
+        case ROMP_NATIVE_FALSE:
+            return Qfalse;
+
+        case ROMP_NATIVE_INTEGER:
+            n = native_get_varint(decoder);
+            return LONG2NUM((long)(n >> 1) ^ -(long)(n & 1));
+
+        case ROMP_NATIVE_FLOAT:
+            native_need(decoder, 8);
+            n = 0;
+            for(j = 0; j < 8; ++j) {
+                n = (n << 8) | *decoder->ptr++;
+            }
+            memcpy(&d, &n, sizeof(d));
+            return rb_float_new(d);
+
+        case ROMP_NATIVE_STRING:
+        case ROMP_NATIVE_UTF8:
+        case ROMP_NATIVE_ASCII:
+        case ROMP_NATIVE_SYMBOL:
+            len = native_get_length(decoder);
+            if(len >= ROMP_RAW_MIN && tag != ROMP_NATIVE_SYMBOL) {
+                obj = native_get_raw(decoder, len);
+            } else {
+                native_need(decoder, len);
+                obj = rb_str_new((const char *)decoder->ptr, len);
+                decoder->ptr += len;
+            }
+#ifdef HAVE_RUBY_ENCODING_H
+            if(tag == ROMP_NATIVE_UTF8) {
+                rb_enc_associate(obj, rb_utf8_encoding());
+            } else if(tag == ROMP_NATIVE_ASCII) {
+                rb_enc_associate(obj, rb_usascii_encoding());
+            }
+#endif
+            return tag == ROMP_NATIVE_SYMBOL ? rb_str_intern(obj) : obj;
+
+        case ROMP_NATIVE_ARRAY:
+            len = native_get_length(decoder);
+            obj = rb_ary_new2(len);
+            for(j = 0; j < len; ++j) {
+                rb_ary_push(obj, native_decode_value(decoder, depth + 1));
+            }
+            return obj;
+
+        case ROMP_NATIVE_HASH:
+            len = native_get_length(decoder);
+            obj = rb_hash_new();
+            for(j = 0; j < len; ++j) {
+                key = native_decode_value(decoder, depth + 1);
+                rb_hash_aset(obj, key, native_decode_value(decoder, depth + 1));
+            }
+            return obj;
+
+        default:
+            native_bad_data();
+            return Qnil;
+    }
+}
+
+static VALUE native_decode_all(VALUE ruby_decoder) {
+    Native_Decoder * decoder = (Native_Decoder *)(ruby_decoder);
+    VALUE obj = native_decode_value(decoder, 0);
+
+    if(decoder->ptr != decoder->limit) {
+        native_bad_data();
+    }
+    return obj;
+}
+
+// Decode a message encoded by native_encode, found in the len bytes at
+// data.  source is the String the data is in, or nil if it is not in one.
+static VALUE native_decode(VALUE source, const char * data, size_t len) {
+    Native_Decoder decoder;
+
+    decoder.source = source;
+    decoder.start = (const unsigned char *)data;
+    decoder.ptr = decoder.start;
+    decoder.end = decoder.ptr + len;
+    decoder.limit = decoder.end;
+    decoder.fd = -1;
+    decoder.nonblock = 0;
+    return native_decode_all((VALUE)(&decoder));
+}
+
+// Decode a message encoded by native_encode, of which the first avail of
+// len bytes are at data, reading the rest from fd as it goes.  There must
+// be room for all len bytes at data, though large Strings are read into
+// Strings of their own instead.  If the data turns out to be bad, the rest
+// of it is still read, so the next message can be.
+static VALUE native_decode_stream(
+        char * data, size_t avail, size_t len, int fd, int nonblock) {
+
+    Native_Decoder decoder;
+    VALUE obj;
+    int status;
+
+    decoder.source = Qnil;
+    decoder.start = (const unsigned char *)data;
+    decoder.ptr = decoder.start;
+    decoder.end = decoder.ptr + avail;
+    decoder.limit = decoder.ptr + len;
+    decoder.fd = fd;
+    decoder.nonblock = nonblock;
+
+    obj = rb_protect(native_decode_all, (VALUE)(&decoder), &status);
+    if(status) {
+        if(decoder.end < decoder.limit) {
+            ruby_read_throw(
+                fd,
+                (char *)decoder.end,
+                decoder.limit - decoder.end,
+                decoder.limit - decoder.end,
+                nonblock);
+        }
+        rb_jump_tag(status);
+    }
+    return obj;
+}
+
+// ---------------------------------------------------------------------------
+// Session functions
+// ---------------------------------------------------------------------------
+
+#define ROMP_REQUEST           0x1001
+#define ROMP_REQUEST_BLOCK     0x1002
+#define ROMP_ONEWAY            0x1003
+#define ROMP_ONEWAY_SYNC       0x1004
+#define ROMP_PIPELINE          0x1005
+#define ROMP_RETVAL            0x2001
+#define ROMP_EXCEPTION         0x2002
+#define ROMP_YIELD             0x2003
+#define ROMP_YIELD_BATCH       0x2004
+#define ROMP_SYNC              0x4001
+#define ROMP_NULL_MSG          0x4002
+#define ROMP_HELLO             0x4003
+#define ROMP_RELEASE           0x4004
+#define ROMP_CREDIT            0x4005
+#define ROMP_MSG_START         0x4242
+#define ROMP_MSG_START_V2      0x4243
+#define ROMP_NATIVE            0x8000   // message type flag: data is not Marshal'd
+#define ROMP_MAX_ID_V1         (1<<16)
+#define ROMP_MAX_MSG_TYPE      (1<<16)
+#define ROMP_PROTOCOL_VERSION  7
+
+#define ROMP_BUFFER_SIZE       16       // header size in protocol version 1
+#define ROMP_BUFFER_SIZE_V2    20       // header size in protocol version 2
+#define ROMP_STAGING_SIZE      4096
+#define ROMP_READAHEAD_SIZE    8192
+#define ROMP_PROMISE_SLOTS     256
+#define ROMP_MAX_METHODS       4096     // interned method names per session
+#define ROMP_YIELD_BATCH_SIZE  1        // default yielded values per batch
+#define ROMP_YIELD_BATCH_BYTES 65536    // about how much data a batch holds
+#define ROMP_YIELD_BATCH_USEC  2000     // how long a batch is held back
+#define ROMP_STREAM_WINDOW     1024     // default yielded values in flight
+#define ROMP_CURSOR_PAGE       1024     // default most values fetched at once
+#define ROMP_MESSAGE_LIMIT     (64<<20) // default largest message received
+
+// The object id of a CREDIT message says what it does.
+#define ROMP_CREDIT_OPEN       0        // a block call is about to start
+#define ROMP_CREDIT_MORE       1        // the client has taken some values
+#define ROMP_CREDIT_CANCEL     2        // the client wants no more values
+
+// References to remote objects that the client no longer holds, waiting to
+// be sent to the server in a RELEASE message.  The queue is filled by the
+// garbage collector as Proxy_Objects are freed, which may happen after the
+// session itself has been freed, so it is shared between the session and
+// its proxies and goes away with the last of them.  Since it is used while
+// the collector runs, it only uses plain C memory.
+typedef struct {
+    int refcount;
+    uint32_t * entries;     // object id, count, object id, count, ...
+    size_t len, capacity;
+} ROMP_Release_Queue;
+
+typedef uint16_t MESSAGE_TYPE_T;
+typedef uint32_t OBJECT_ID_T;
+typedef uint32_t REQUEST_ID_T;
+
+// A ROMP message is broken into 3 components (see romp.rb for more details),
+// plus the id of the request it belongs to (0 if no reply is expected) and,
+// for a PIPELINE request, the id of the earlier request whose result it is
+// aimed at.
+typedef struct {
+    MESSAGE_TYPE_T message_type;
+    OBJECT_ID_T object_id;
+    VALUE message_obj;
+    REQUEST_ID_T request_id;
+    REQUEST_ID_T promise_id;
+} ROMP_Message;
+
+// The fields of a message header, as read by get_header.
+typedef struct {
+    size_t data_len;
+    int native;
+    MESSAGE_TYPE_T message_type;
+    OBJECT_ID_T object_id;
+    REQUEST_ID_T request_id;
+    REQUEST_ID_T promise_id;
+} ROMP_Header;
+
+typedef struct {
+    VALUE io_object;
+    int read_fd, write_fd;
+    char buf[ROMP_BUFFER_SIZE_V2];
+    int nonblock;
+
+    // The protocol version in use on this session; every session starts out
+    // speaking version 1 until a HELLO exchange says otherwise.
+    int version;
+    size_t header_size;
+
+    // Outgoing messages that fit are assembled here (header followed by
+    // data) so they can be sent with a single write.
+    char staging[ROMP_STAGING_SIZE];
+
+    // Incoming data is read into this buffer as fast as the peer sends it;
+    // bytes between read_start and read_end have been received but not yet
+    // consumed by get_message.
+    char readahead[ROMP_READAHEAD_SIZE];
+    size_t read_start, read_end;
+
+    // Every request that expects a reply is tagged with a request id, and
+    // the reply carries the same id back, so several threads can have
+    // requests outstanding on one session at the same time.  Whichever
+    // waiting thread is not blocked on reply_cond does the reading (see
+    // session_wait_reply); replies it reads for other requests are left in
+    // replies (id => [message, ...]) for their owners.  Replies to requests
+    // whose caller has given up (id => true in abandoned) are thrown away.
+    uint32_t next_request_id;
+    VALUE replies;
+    VALUE abandoned;
+    int reading;
+    VALUE reply_mutex;  // nil unless the session is shared between threads
+    VALUE reply_cond;
+
+    // A message too large for the read-ahead buffer that
+    // session_poll_message has started gathering in the input frame buffer
+    // (partial_len bytes of its data so far), for get_message to finish.
+    // Used by clients polling for replies and by the reactor, which must not
+    // hand a worker a message that is still on its way.
+    int partial;
+    ROMP_Header partial_header;
+    size_t partial_len;
+
+    // On the client, the request ids of Futures that were collected before
+    // their reply was picked up (id, 0, id, 0, ...), to be abandoned.
+    ROMP_Release_Queue * dropped;
+
+    // Threads that are batching requests (thread => String); their
+    // messages are collected here and written all at once.
+    VALUE batches;
+
+    // On the server, the remote objects returned by the most recent
+    // requests, so that PIPELINE requests can be aimed at them.  Entry
+    // request_id % ROMP_PROMISE_SLOTS is [request_id, Object_Reference].
+    VALUE promises;
+
+    // On the server, the objects registered on this session's behalf
+    // (__id__ => [object, handle]) when references are scoped to the
+    // connection, so they can all be released when it goes away.
+    VALUE references;
+
+    // On the server, how many counted references (handle => count) have
+    // been handed to the client and not yet released, so they can be
+    // released for it when it goes away.
+    VALUE handed;
+
+    // On the client, remote objects to release (see Proxy_Object).
+    ROMP_Release_Queue * releases;
+
+    // On the server, the most yielded values to send in one YIELD_BATCH
+    // message; 1 sends each in a YIELD of its own.  Each batch is pushed
+    // onto yield_queue ([session, values, request id, time]) when it is
+    // started, so the Server's flusher thread can send it once it has
+    // waited long enough (see server_send_yield).
+    long yield_batch;
+    VALUE yield_queue;
+
+    // Frame buffers: natively encoded messages are built in output (see
+    // send_message), and large incoming ones are read into input (see
+    // get_message).  Neither keeps more than frame_limit bytes between
+    // frames.
+    ROMP_Frame_Buffer output;
+    ROMP_Frame_Buffer input;
+    size_t frame_limit;
+
+    // In reactor mode, true from when the reactor hands the session to a
+    // worker until the worker rearms it; the reactor leaves the frame
+    // buffers of such a session alone.
+    int dispatched;
+
+    // The largest message data the peer may send; a header claiming more
+    // is refused before anything is allocated for it.
+    size_t message_limit;
+
+    // On the client, the Proxy_Objects made from references the server
+    // returned (object id => proxy, held weakly), so that every reference
+    // to the same object comes back as the same proxy.  Created when it is
+    // first needed; stays nil if weak maps are not usable.
+    VALUE proxies;
+
+    // From protocol version 3 on, the client gives each method name it
+    // calls a small id (method_ids, name => id), and sends the id in place
+    // of the name once the server is known to have been told it (the bit
+    // for it is set in methods_sent).  The server keeps the names it has
+    // been told in methods (id => name).
+    VALUE method_ids;
+    uint32_t next_method_id;
+    unsigned char methods_sent[ROMP_MAX_METHODS / 8];
+    VALUE methods;
+
+    // Calls with a block are streamed with a window of credit from
+    // protocol version 6 on.  The client lets the server yield at most
+    // stream_window values it has not taken yet (0 for no limit), and the
+    // server keeps the credit granted to each call it is streaming in
+    // credits (request id => values, for calls that are waiting).
+    long stream_window;
+    VALUE credits;
+
+    // On the server, a streamed call that has run out of credit is parked:
+    // it waits for more on the thread it was running on, and the session
+    // is handed to another thread to go on serving (see server_park).
+    // From the first time that happens (or a batch of yielded values is
+    // started), credit is handed out holding stream_mutex, with
+    // stream_cond broadcast whenever more comes in, and every message is
+    // written holding write_mutex; all three are nil until then.
+    // parked counts the parked calls that are not over yet.  Once the
+    // session is closed, closed is set, so they write nothing more.
+    VALUE write_mutex;
+    VALUE stream_mutex;
+    VALUE stream_cond;
+    int parked;
+    int closed;
+
+    // On the client, the most values a remote Enumerator fetches from its
+    // cursor at a time (see ROMP.remote_enumerator).
+    long page_size;
+
+    // On the client, ONEWAY messages are held in cork while corking is on
+    // (cork_limit is not 0), and written all at once when cork_limit bytes
+    // have piled up, when the first of them has waited cork_delay
+    // microseconds, or before any other message goes out.  Only used while
+    // holding the write mutex.  If cork_queue is set, true is pushed onto
+    // it whenever a message goes into an empty cork, so a thread that
+    // flushes the cork can sleep while there is nothing to flush.
+    ROMP_Buffer cork;
+    size_t cork_limit;
+    long cork_delay;
+    struct timeval cork_time;
+    VALUE cork_queue;
+} ROMP_Session;
+
+static void session_set_version(ROMP_Session * session, int version) {
+    session->version = version;
+    session->header_size = version >= 2 ? ROMP_BUFFER_SIZE_V2 : ROMP_BUFFER_SIZE;
+}
+
+// Raise an exception if message, with len bytes of data, cannot be sent
+// with the session's protocol version.  Version 1 has only 16 bits for the
+// length and object id, version 2 has 32.
+static void check_message(ROMP_Session * session, size_t len, const ROMP_Message * message) {
+    if(session->version < 2 && len > 0xffff) {
+        rb_raise(
+            rb_eArgError,
+            "Message too large for protocol version 1 (%lu bytes)",
+            (unsigned long)len);
+    } else if(session->version < 2 && message->object_id >= ROMP_MAX_ID_V1) {
+        rb_raise(
+            rb_eRangeError,
+            "Object id %lu too large for protocol version 1",
+            (unsigned long)message->object_id);
+    } else if((uint64_t)len > 0xffffffffUL) {
+        rb_raise(
+            rb_eArgError,
+            "Message too large (%lu bytes)",
+            (unsigned long)len);
+    }
+}
+
+// Write the header for message, with data length len, into buf, in the
+// format for the given protocol version.  native says whether the data is
+// natively encoded (version 4 and later only).  Returns the size of the
+// header (ROMP_BUFFER_SIZE or ROMP_BUFFER_SIZE_V2).
+static size_t put_header(
+        int version,
+        char * buf,
+        size_t len,
+        const ROMP_Message * message,
+        int native) {
+
+    if(version >= 2) {
+        PUTSHORT(ROMP_MSG_START_V2,         buf);
+        PUTSHORT(message->message_type | (native ? ROMP_NATIVE : 0), buf);
+        PUTLONG(len,                        buf);
+        PUTLONG(message->object_id,         buf);
+        PUTLONG(message->request_id,        buf);
+        PUTLONG(message->promise_id,        buf);
+        return ROMP_BUFFER_SIZE_V2;
+    }
+
+    PUTSHORT(ROMP_MSG_START,            buf);
+    PUTSHORT(len,                       buf);
+    PUTSHORT(message->message_type,     buf);
+    PUTSHORT(message->object_id,        buf);
+    PUTLONG(message->request_id,        buf);
+    PUTLONG(message->promise_id,        buf);
+    return ROMP_BUFFER_SIZE;
+}
+
+// Parse the header at buf, which holds at least as many bytes as a header
+// for the given protocol version takes.  Returns false if the header does
+// not start with the right magic number.
+static int get_header(int version, const char * buf, ROMP_Header * header) {
+    uint16_t magic, short_len;
+    uint32_t long_len, long_object_id;
+
+    if(version >= 2) {
+        GETSHORT(magic,                 buf);
+        GETSHORT(header->message_type,  buf);
+        GETLONG(long_len,               buf);
+        GETLONG(long_object_id,         buf);
+        GETLONG(header->request_id,     buf);
+        GETLONG(header->promise_id,     buf);
+        header->data_len = long_len;
+        header->object_id = long_object_id;
+        header->native = (header->message_type & ROMP_NATIVE) != 0;
+        header->message_type &= ~ROMP_NATIVE;
+        return magic == ROMP_MSG_START_V2;
+    }
+
+    GETSHORT(magic,                 buf);
+    GETSHORT(short_len,             buf);
+    GETSHORT(header->message_type,  buf);
+    GETSHORT(header->object_id,     buf);
+    GETLONG(header->request_id,     buf);
+    GETLONG(header->promise_id,     buf);
+    header->data_len = short_len;
+    header->native = 0;
+    return magic == ROMP_MSG_START;
+}
+
+// Send a message to the server with data data and length len.  The header
+// and data always go out in a single system call: small messages are copied
+// into the session's staging buffer, and larger ones are sent with writev so
+// the data does not have to be copied.
+static void send_message_helper(
+        ROMP_Session * session,
+        const char * data,
+        size_t len,
+        const ROMP_Message * message,
+        int native) {
+
+    struct iovec iov[2];
+    size_t header_size;
+
+    check_message(session, len, message);
+
+    if(len <= ROMP_STAGING_SIZE - ROMP_BUFFER_SIZE_V2) {
+        header_size = put_header(
+            session->version, session->staging, len, message, native);
+        memcpy(session->staging + header_size, data, len);
+        ruby_write_throw(
+            session->write_fd,
+            session->staging,
+            header_size + len,
+            session->nonblock);
+    } else {
+        header_size = put_header(
+            session->version, session->buf, len, message, native);
+        iov[0].iov_base = session->buf;
+        iov[0].iov_len = header_size;
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = len;
+        ruby_writev_throw(session->write_fd, iov, 2, session->nonblock);
+    }
+}
+
+// Encode the data for a message natively into buf, if the session's
+// protocol version allows and the data is simple enough, leaving room for
+// the header (which from version 4 on is always ROMP_BUFFER_SIZE_V2 bytes)
+// at the front.  Once the data is encoded, writes the header there and
+// fills in iov.  Returns the number of iovecs, or 0 if the data must be
+// sent with Marshal.
+static int session_encode(
+        ROMP_Session * session,
+        const ROMP_Message * message,
+        ROMP_Buffer * buf,
+        Message_Data * data,
+        struct iovec * iov) {
+
+    size_t len;
+    int iovcnt;
+
+    if(   session->version < 4
+       || !native_encode(data, buf, ROMP_BUFFER_SIZE_V2, message->message_obj)) {
+        return 0;
+    }
+
+    iovcnt = message_data_iov(data, iov, &len);
+    check_message(session, len - ROMP_BUFFER_SIZE_V2, message);
+    put_header(
+        session->version, buf->ptr, len - ROMP_BUFFER_SIZE_V2, message, 1);
+    return iovcnt;
+}
+
+// Arguments for send_native, below.
+typedef struct {
+    ROMP_Session * session;
+    struct iovec * iov;
+    int iovcnt;
+    const Message_Data * data;
+    int locked;             // how many of data's raw strings are locked
+} Native_Send;
+
+static VALUE send_native(VALUE ruby_native_send) {
+    Native_Send * native_send = (Native_Send *)(ruby_native_send);
+    ruby_writev_throw(
+        native_send->session->write_fd,
+        native_send->iov,
+        native_send->iovcnt,
+        native_send->session->nonblock);
+    return Qnil;
+}
+
+// Lock the raw strings one at a time (locking one may raise, e.g. if
+// another thread is sending it), then send.
+static VALUE send_native_raw(VALUE ruby_native_send) {
+    Native_Send * native_send = (Native_Send *)(ruby_native_send);
+
+    while(native_send->locked < native_send->data->num_raw) {
+        rb_str_locktmp(native_send->data->raw[native_send->locked].str);
+        ++native_send->locked;
+    }
+    return send_native(ruby_native_send);
+}
+
+// Unlock the raw strings send_native_raw managed to lock.
+static VALUE unlock_raw_strings(VALUE ruby_native_send) {
+    const Native_Send * native_send = (const Native_Send *)(ruby_native_send);
+    int j;
+
+    for(j = 0; j < native_send->locked; ++j) {
+        rb_str_unlocktmp(native_send->data->raw[j].str);
+    }
+    return Qnil;
+}
+
+// Send a message to the server with the data in message.  Natively
+// encoded data is sent from the session's output frame buffer (which is
+// only used while holding the session's write mutex).  Strings that are
+// sent in place are locked until they have been written, since the write
+// may happen while other threads run.
+static void send_message(ROMP_Session * session, ROMP_Message * message) {
+    Message_Data data;
+    Native_Send native_send;
+    struct iovec iov[2 * ROMP_RAW_MAX + 1];
+    VALUE marshalled;
+    size_t len;
+
+    native_send.session = session;
+    native_send.iov = iov;
+    native_send.data = &data;
+    native_send.locked = 0;
+    native_send.iovcnt = session_encode(
+        session, message, &session->output.buf, &data, iov);
+
+    len = session->output.buf.len;
+    if(native_send.iovcnt == 0) {
+        marshalled = marshal_dump(message->message_obj);
+        len = RSTRING_LEN(marshalled);
+        send_message_helper(
+            session,
+            RSTRING_PTR(marshalled),
+            RSTRING_LEN(marshalled),
+            message,
+            0);
+    } else if(data.num_raw == 0) {
+        send_native((VALUE)(&native_send));
+    } else {
+        rb_ensure(
+            send_native_raw, (VALUE)(&native_send),
+            unlock_raw_strings, (VALUE)(&native_send));
+    }
+
+    frame_done(&session->output, len, session->frame_limit);
+}
+
+// Return the buffer the current thread is batching messages into, or nil if
+// it is not batching.
+static VALUE session_batch(ROMP_Session * session) {
+    return rb_hash_aref(session->batches, rb_thread_current());
+}
+
+// Append a message, header and all, to out instead of sending it.  It is
+// encoded natively in scratch, if it can be.
+static void append_message(
+        ROMP_Session * session,
+        ROMP_Buffer * scratch,
+        ROMP_Message * message,
+        ROMP_Buffer * out) {
+
+    Message_Data data;
+    struct iovec iov[2 * ROMP_RAW_MAX + 1];
+    char header[ROMP_BUFFER_SIZE_V2];
+    size_t header_size;
+    VALUE marshalled;
+    int iovcnt, j;
+
+    iovcnt = session_encode(session, message, scratch, &data, iov);
+    for(j = 0; j < iovcnt; ++j) {
+        buffer_cat(out, iov[j].iov_base, iov[j].iov_len);
+    }
+    if(iovcnt != 0) {
+        return;
+    }
+
+    marshalled = marshal_dump(message->message_obj);
+    check_message(session, RSTRING_LEN(marshalled), message);
+    header_size = put_header(
+        session->version, header, RSTRING_LEN(marshalled), message, 0);
+    buffer_cat(out, header, header_size);
+    buffer_cat(out, RSTRING_PTR(marshalled), RSTRING_LEN(marshalled));
+}
+
+// Arguments for batch_append and batch_free, below.
+typedef struct {
+    ROMP_Session * session;
+    VALUE batch;
+    ROMP_Message * message;
+    ROMP_Buffer scratch;
+    ROMP_Buffer out;
+} Batch_Message;
+
+static VALUE batch_append(VALUE ruby_batch_message) {
+    Batch_Message * bm = (Batch_Message *)(ruby_batch_message);
+    append_message(bm->session, &bm->scratch, bm->message, &bm->out);
+    rb_str_cat(bm->batch, bm->out.ptr, bm->out.len);
+    return Qnil;
+}
+
+static VALUE batch_free(VALUE ruby_batch_message) {
+    Batch_Message * bm = (Batch_Message *)(ruby_batch_message);
+    xfree(bm->scratch.ptr);
+    xfree(bm->out.ptr);
+    return Qnil;
+}
+
+// Add a message to a batch instead of sending it.
+// Threads batch without holding the write mutex, so the message is
+// encoded in buffers of its own, which are freed even if encoding raises
+// (e.g. for an argument Marshal cannot dump).
+static void batch_message(ROMP_Session * session, VALUE batch, ROMP_Message * message) {
+    Batch_Message bm;
+
+    memset(&bm, 0, sizeof(bm));
+    bm.session = session;
+    bm.batch = batch;
+    bm.message = message;
+    rb_ensure(batch_append, (VALUE)(&bm), batch_free, (VALUE)(&bm));
+}
+
+// Write out the ONEWAY messages held in the session's cork, if any.  The
+// caller must hold the write mutex.
+static void session_flush_cork(ROMP_Session * session) {
+    size_t len = session->cork.len;
+
+    if(len == 0) {
+        return;
+    }
+    session->cork.len = 0;
+    ruby_write_throw(
+        session->write_fd, session->cork.ptr, len, session->nonblock);
+}
+
+// Hold a ONEWAY message in the session's cork (see ROMP_Session), and write
+// the cork out if it is full or has been held long enough.  The caller
+// must hold the write mutex.
+static void session_cork_message(ROMP_Session * session, ROMP_Message * message) {
+    size_t start = session->cork.len;
+    struct timeval now;
+    long usec;
+
+    gettimeofday(&now, 0);
+    if(start == 0) {
+        session->cork_time = now;
+        if(!NIL_P(session->cork_queue)) {
+            rb_funcall(session->cork_queue, id_push, 1, Qtrue);
+        }
+    }
+    append_message(session, &session->output.buf, message, &session->cork);
+    frame_done(
+        &session->output, session->cork.len - start, session->frame_limit);
+
+    usec = (now.tv_sec - session->cork_time.tv_sec) * 1000000
+         + (now.tv_usec - session->cork_time.tv_usec);
+    if(session->cork.len >= session->cork_limit || usec >= session->cork_delay) {
+        session_flush_cork(session);
+    }
+}
+
+// Arguments for batch_write, below.
+typedef struct {
+    ROMP_Session * session;
+    VALUE data;
+} Batch_Write;
+
+static VALUE batch_write(VALUE ruby_batch_write) {
+    Batch_Write * batch_write = (Batch_Write *)(ruby_batch_write);
+    session_flush_cork(batch_write->session);
+    ruby_write_throw(
+        batch_write->session->write_fd,
+        RSTRING_PTR(batch_write->data),
+        RSTRING_LEN(batch_write->data),
+        batch_write->session->nonblock);
+    return Qnil;
+}
+
+// Send everything the current thread has batched so far with a single
+// write, holding mutex while doing so.  Unless finish is set, the thread
+// keeps batching.
+static void session_flush_batch(ROMP_Session * session, VALUE mutex, int finish) {
+    Batch_Write write;
+
+    write.session = session;
+    write.data = session_batch(session);
+    if(NIL_P(write.data)) {
+        return;
+    }
+
+    if(finish) {
+        rb_hash_delete(session->batches, rb_thread_current());
+    } else if(RSTRING_LEN(write.data) != 0) {
+        rb_hash_aset(session->batches, rb_thread_current(), rb_str_new(0, 0));
+    }
+    if(RSTRING_LEN(write.data) == 0) {
+        return;
+    }
+
+    ruby_lock(mutex);
+    rb_ensure(batch_write, (VALUE)(&write), ruby_unlock, mutex);
+}
+
+// Send a null message to the server (no data, data len = 0)
+static void send_null_message(ROMP_Session * session, REQUEST_ID_T request_id) {
+    ROMP_Message message = { ROMP_NULL_MSG, 0, Qnil, request_id, 0 };
+    send_message_helper(session, "", 0, &message, 0);
+}
+
+// Arguments for server_write, below.
+typedef struct {
+    ROMP_Session * session;
+    ROMP_Message * message;
+} Server_Write;
+
+static VALUE server_write(VALUE ruby_server_write) {
+    Server_Write * write = (Server_Write *)(ruby_server_write);
+
+    if(write->session->closed) {
+        rb_raise(rb_eIOError, "Connection closed");
+    }
+    if(write->message->message_type == ROMP_NULL_MSG) {
+        send_null_message(write->session, write->message->request_id);
+    } else {
+        send_message(write->session, write->message);
+    }
+    return Qnil;
+}
+
+// Call func with arg, holding the session's write mutex if it has one.
+static void server_locked(ROMP_Session * session, VALUE (*func)(VALUE), VALUE arg) {
+    if(NIL_P(session->write_mutex)) {
+        func(arg);
+        return;
+    }
+    ruby_lock(session->write_mutex);
+    rb_ensure(func, arg, ruby_unlock, session->write_mutex);
+}
+
+// Create the mutexes and the condition variable for a session that is
+// about to have more than one thread writing to it (see ROMP_Session).
+static void server_init_locks(ROMP_Session * session) {
+    if(!NIL_P(session->write_mutex)) {
+        return;
+    }
+    session->write_mutex = rb_class_new_instance(
+        0, 0, rb_path2class("Mutex"));
+    session->stream_mutex = rb_class_new_instance(
+        0, 0, rb_path2class("Mutex"));
+    session->stream_cond = rb_class_new_instance(
+        0, 0, rb_path2class("ConditionVariable"));
+}
+
+// Send a message to the client.  Once a streamed call has been parked
+// (see server_park) or a batch of yielded values started, the threads
+// serving the session, finishing parked calls and flushing batches may all
+// be writing to it, so each message is written holding the session's
+// write mutex.
+static void server_send(ROMP_Session * session, ROMP_Message * message) {
+    Server_Write write;
+
+    write.session = session;
+    write.message = message;
+    server_locked(session, server_write, (VALUE)(&write));
+}
+
+// Arguments for server_write_yields, below.
+typedef struct {
+    ROMP_Session * session;
+    VALUE yields;
+    REQUEST_ID_T request_id;
+} Yield_Flush;
+
+// Send the values in a batch to the client: a YIELD if there is only one,
+// and a YIELD_BATCH if there are more.  The batch is emptied before the
+// values go out, so they are only ever sent once, by whichever thread gets
+// to them first.  Must be called holding the write mutex, if there is one.
+static VALUE server_write_yields(VALUE ruby_yield_flush) {
+    Yield_Flush * flush = (Yield_Flush *)(ruby_yield_flush);
+    ROMP_Message message = { ROMP_YIELD, 0, Qnil, flush->request_id, 0 };
+    Server_Write write;
+    long len = RARRAY_LEN(flush->yields);
+
+    if(len == 0) {
+        return Qnil;
+    }
+    if(len == 1) {
+        message.message_obj = RARRAY_PTR(flush->yields)[0];
+    } else {
+        message.message_type = ROMP_YIELD_BATCH;
+        message.message_obj = rb_ary_new4(len, RARRAY_PTR(flush->yields));
+    }
+    rb_ary_clear(flush->yields);
+
+    write.session = flush->session;
+    write.message = &message;
+    return server_write((VALUE)(&write));
+}
+
+// Send whatever is left of a batch of yielded values.
+static void server_send_yields(
+        ROMP_Session * session, VALUE yields, REQUEST_ID_T request_id) {
+    Yield_Flush flush;
+
+    flush.session = session;
+    flush.yields = yields;
+    flush.request_id = request_id;
+    server_locked(session, server_write_yields, (VALUE)(&flush));
+}
+
+// Make sure at least count bytes (count <= ROMP_READAHEAD_SIZE) are in the
+// session's read-ahead buffer.  Each read pulls in as much as the socket
+// has available, so a burst of small messages is usually picked up with a
+// single system call.  This may run without the interpreter lock; it
+// returns false (with the reason in io) if the bytes could not be read yet.
+static int session_fill(ROMP_Session * session, size_t count, ROMP_IO * io) {
+    size_t avail = session->read_end - session->read_start;
+
+    if(avail >= count) {
+        return 1;
+    }
+
+    // Shift any leftover bytes to the front to make room.
+    if(session->read_start != 0) {
+        memmove(
+            session->readahead,
+            session->readahead + session->read_start,
+            avail);
+        session->read_start = 0;
+        session->read_end = avail;
+    }
+
+    io->buf = session->readahead + session->read_end;
+    io->max = ROMP_READAHEAD_SIZE - session->read_end;
+    io->count = count - avail;
+    io->total = 0;
+    io_read(io);
+    session->read_end += io->total;
+
+    return io->count == 0;
+}
+
+// Arguments for receive_header, below.
+typedef struct {
+    ROMP_IO io;
+    ROMP_Session * session;
+    ROMP_Header header;
+} ROMP_Receive;
+
+// Read and parse the next message header, along with the message data if it
+// fits in the read-ahead buffer.  This runs without the interpreter lock
+// when possible.  It may be called again after returning early (if the
+// socket had nothing to read); the header is only consumed once everything
+// is in place.
+static void * receive_header(void * ptr) {
+    ROMP_Receive * receive = (ROMP_Receive *)ptr;
+    ROMP_Session * session = receive->session;
+    size_t header_size = session->header_size;
+
+    for(;;) {
+        if(!session_fill(session, header_size, &receive->io)) {
+            return 0;
+        }
+
+        if(!get_header(
+                session->version,
+                session->readahead + session->read_start,
+                &receive->header)) {
+            session->read_start += header_size;
+            continue;
+        }
+
+        if(   receive->header.data_len <= ROMP_READAHEAD_SIZE - header_size
+           && !session_fill(
+                  session,
+                  header_size + receive->header.data_len,
+                  &receive->io)) {
+            return 0;
+        }
+
+        session->read_start += header_size;
+        receive->io.count = 0;
+        return 0;
+    }
+}
+
+// Read len bytes of message data, too many for the read-ahead buffer, into
+// ptr: first whatever has already been buffered, then the rest directly
+// from the socket.
+static void session_read_large(ROMP_Session * session, char * ptr, size_t len) {
+    size_t avail = session->read_end - session->read_start;
+
+    memcpy(ptr, session->readahead + session->read_start, avail);
+    session->read_start = session->read_end = 0;
+    ruby_read_throw(
+        session->read_fd,
+        ptr + avail,
+        len - avail,
+        len - avail,
+        session->nonblock);
+}
+
+// Read len bytes of message data from the session into a new Ruby string.
+static VALUE session_read_string(ROMP_Session * session, size_t len) {
+    VALUE ruby_str;
+
+    if(len <= ROMP_READAHEAD_SIZE - session->header_size) {
+        // receive_header already made sure the data is here.
+        ruby_str = rb_str_new(session->readahead + session->read_start, len);
+        session->read_start += len;
+    } else {
+        ruby_str = rb_str_new(0, len);
+        session_read_large(session, RSTRING_PTR(ruby_str), len);
+    }
+
+    return ruby_str;
+}
+
+// Finish reading the message session_poll_message started gathering, and
+// decode it.  Large Strings in the part of a native message that was
+// already gathered are copied out of the frame buffer; the rest are read
+// into Strings of their own.
+static void session_finish_partial(ROMP_Session * session, ROMP_Message * message) {
+    ROMP_Header * header = &session->partial_header;
+    size_t len = header->data_len;
+    char * data = session->input.buf.ptr;
+
+    session->partial = 0;
+    message->message_type = header->message_type;
+    message->object_id = header->object_id;
+    message->request_id = header->request_id;
+    message->promise_id = header->promise_id;
+
+    if(header->native && message->message_type != ROMP_NULL_MSG) {
+        message->message_obj = native_decode_stream(
+            data,
+            session->partial_len,
+            len,
+            session->read_fd,
+            session->nonblock);
+    } else {
+        ruby_read_throw(
+            session->read_fd,
+            data + session->partial_len,
+            len - session->partial_len,
+            len - session->partial_len,
+            session->nonblock);
+        message->message_obj = message->message_type == ROMP_NULL_MSG
+            ? Qnil
+            : marshal_load(rb_str_new(data, len));
+    }
+
+    frame_done(&session->input, len, session->frame_limit);
+}
+
+#ifdef ROMP_RELEASE_GVL
+
+// Arguments for idle_wait, below.
+typedef struct {
+    int fd;
+    int ready;
+} Idle_Wait;
+
+// Wait up to ROMP_FRAME_IDLE milliseconds for fd to become readable.  This
+// runs without the interpreter lock.
+static void * idle_wait(void * ptr) {
+    Idle_Wait * wait = (Idle_Wait *)ptr;
+    struct pollfd pfd;
+
+    pfd.fd = wait->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    wait->ready = poll(&pfd, 1, ROMP_FRAME_IDLE) != 0;
+    return 0;
+}
+
+#endif
+
+// Called before blocking for the next message: if nothing arrives for
+// ROMP_FRAME_IDLE milliseconds, trim the session's frame buffers, so that
+// a connection that has gone quiet does not hold on to them.  The output
+// buffer is left alone if the session is shared between threads, since
+// another thread may be sending.  (Without a way to release the
+// interpreter lock there is nothing to wait with, so nothing is trimmed.)
+static void session_wait_idle(ROMP_Session * session) {
+#ifdef ROMP_RELEASE_GVL
+    int shared = !NIL_P(session->reply_mutex);
+    Idle_Wait wait;
+
+    if(   session->read_start != session->read_end
+       || (   session->input.buf.capacity <= ROMP_FRAME_MIN
+           && (shared || session->output.buf.capacity <= ROMP_FRAME_MIN))) {
+        return;
+    }
+
+    wait.fd = session->read_fd;
+    wait.ready = 1;
+    rb_thread_call_without_gvl(idle_wait, &wait, RUBY_UBF_IO, 0);
+    if(!wait.ready) {
+        frame_trim(&session->input);
+        if(!shared) {
+            frame_trim(&session->output);
+        }
+    }
+#endif
+}
+
+// Receive a message from the server.  A natively encoded message that fits
+// in the read-ahead buffer is decoded right where it is, and one that fits
+// in the session's input frame buffer is read in there as it is decoded,
+// except that its large Strings are read straight into Strings of their
+// own; other messages are read into a String first.  Large Strings in a
+// message decoded from a String share its memory, so they are not copied
+// either.  Reading into the frame buffer saves allocating a String for the
+// whole message, and a String kept from it does not keep the rest alive.
+static void get_message(ROMP_Session * session, ROMP_Message * message) {
+    ROMP_Receive receive;
+    VALUE ruby_str;
+    size_t len, avail;
+    const char * data;
+
+    if(session->partial) {
+        session_finish_partial(session, message);
+        return;
+    }
+
+    memset(&receive, 0, sizeof(receive));
+    receive.session = session;
+    receive.io.fd = session->read_fd;
+    receive.io.nonblock = session->nonblock;
+    receive.io.count = 1;
+
+    session_wait_idle(session);
+    ruby_run_io(receive_header, &receive.io, POLLIN, "read");
+
+    message->message_type = receive.header.message_type;
+    message->object_id = receive.header.object_id;
+    message->request_id = receive.header.request_id;
+    message->promise_id = receive.header.promise_id;
+    len = receive.header.data_len;
+    if(len > session->message_limit) {
+        rb_raise(
+            rb_eRuntimeError,
+            "Message too large (%lu bytes; the limit is %lu)",
+            (unsigned long)len,
+            (unsigned long)session->message_limit);
+    }
+
+    if(   len <= ROMP_READAHEAD_SIZE - session->header_size
+       && (receive.header.native || message->message_type == ROMP_NULL_MSG)) {
+        // receive_header already made sure the data is here.
+        data = session->readahead + session->read_start;
+        session->read_start += len;
+        message->message_obj = message->message_type == ROMP_NULL_MSG
+            ? Qnil
+            : native_decode(Qnil, data, len);
+    } else if(receive.header.native && len <= session->frame_limit) {
+        buffer_reserve(&session->input.buf, len);
+        avail = session->read_end - session->read_start;
+        memcpy(
+            session->input.buf.ptr,
+            session->readahead + session->read_start,
+            avail);
+        session->read_start = session->read_end = 0;
+        message->message_obj = native_decode_stream(
+            session->input.buf.ptr,
+            avail,
+            len,
+            session->read_fd,
+            session->nonblock);
+    } else {
+        ruby_str = session_read_string(session, len);
+        if(message->message_type == ROMP_NULL_MSG) {
+            message->message_obj = Qnil;
+        } else if(receive.header.native) {
+            message->message_obj = native_decode(
+                ruby_str, RSTRING_PTR(ruby_str), RSTRING_LEN(ruby_str));
+        } else {
+            message->message_obj = marshal_load(ruby_str);
+        }
+    }
+
+    frame_done(&session->input, len, session->frame_limit);
+}
+
+// Return true if the read-ahead buffer holds a complete message, or at least
+// as much of one as it ever will (a message too large for the buffer is
+// read straight from the socket by get_message).  A bad header also counts,
+// so that get_message gets a chance to resynchronize.
+static int session_has_message(ROMP_Session * session) {
+    size_t avail = session->read_end - session->read_start;
+    size_t header_size = session->header_size;
+    ROMP_Header header;
+
+    if(avail < header_size) {
+        return 0;
+    }
+
+    return !get_header(
+               session->version,
+               session->readahead + session->read_start,
+               &header)
+        || header.data_len > ROMP_READAHEAD_SIZE - header_size
+        || avail >= header_size + header.data_len;
+}
+
+// Return true if the peer has sent something we have not read yet (or has
+// disconnected).
+static int session_readable(ROMP_Session * session) {
+    struct pollfd pfd;
+
+    pfd.fd = session->read_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Read whatever the peer has sent into the read-ahead buffer without
+// blocking and without raising.  Returns the number of bytes read, 0 on
+// end-of-file, or -1 with errno set (EWOULDBLOCK if there was nothing to
+// read).
+static ssize_t session_read_available(ROMP_Session * session) {
+    size_t avail = session->read_end - session->read_start;
+    ssize_t read_count;
+
+    if(session->read_start != 0) {
+        memmove(
+            session->readahead,
+            session->readahead + session->read_start,
+            avail);
+        session->read_start = 0;
+        session->read_end = avail;
+    }
+
+    if(session->read_end == ROMP_READAHEAD_SIZE) {
+        // Full; let get_message drain it before reading any more.
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    read_count = read(
+        session->read_fd,
+        session->readahead + session->read_end,
+        ROMP_READAHEAD_SIZE - session->read_end);
+    if(read_count > 0) {
+        session->read_end += read_count;
+    }
+
+    return read_count;
+}
+
+// Return true if a read that returned read_count hit end-of-file or an
+// error other than there being nothing to read yet.
+static int session_read_failed(ssize_t read_count) {
+    return read_count == 0
+        || (   read_count < 0
+            && errno != EWOULDBLOCK
+            && errno != EAGAIN
+            && errno != EINTR);
+}
+
+// Gather more of the message session_poll_message started on, without
+// blocking.  Returns true once all of it is here.
+static int session_poll_partial(ROMP_Session * session) {
+    size_t len = session->partial_header.data_len;
+    ssize_t read_count;
+
+    while(session->partial_len < len && session_readable(session)) {
+        read_count = read(
+            session->read_fd,
+            session->input.buf.ptr + session->partial_len,
+            len - session->partial_len);
+        if(session_read_failed(read_count)) {
+            return 1;
+        }
+        if(read_count < 0) {
+            break;
+        }
+        session->partial_len += read_count;
+    }
+    return session->partial_len == len;
+}
+
+// Read whatever the peer has sent without blocking, and return true if
+// get_message can now be called without waiting for it: a whole message
+// has arrived (or the peer has gone away or sent a message over the limit,
+// which get_message will report).  A message too large for the read-ahead
+// buffer is gathered in the input frame buffer as it arrives.
+static int session_poll_message(ROMP_Session * session) {
+    size_t header_size = session->header_size;
+    size_t avail;
+    ROMP_Header header;
+
+    if(session->partial) {
+        return session_poll_partial(session);
+    }
+
+    if(   !session_has_message(session)
+       && session_readable(session)
+       && session_read_failed(session_read_available(session))) {
+        return 1;
+    }
+
+    // Skip over bad headers the way receive_header does, so that what is
+    // left is a message get_message can read without waiting.
+    for(;;) {
+        avail = session->read_end - session->read_start;
+        if(avail < header_size) {
+            return 0;
+        }
+        if(get_header(
+                session->version,
+                session->readahead + session->read_start,
+                &header)) {
+            break;
+        }
+        session->read_start += header_size;
+    }
+    if(header.data_len <= ROMP_READAHEAD_SIZE - header_size) {
+        return avail >= header_size + header.data_len;
+    }
+    if(header.data_len > session->message_limit) {
+        // (get_message will refuse it.)
+        return 1;
+    }
+
+    avail -= header_size;
+    buffer_reserve(&session->input.buf, header.data_len);
+    memcpy(
+        session->input.buf.ptr,
+        session->readahead + session->read_start + header_size,
+        avail);
+    session->read_start = session->read_end = 0;
+    session->partial = 1;
+    session->partial_header = header;
+    session->partial_len = avail;
+    return session_poll_partial(session);
+}
+
+// Ideally, this function should return true if the server has disconnected,
+// but currently always returns false.  The server thread will still exit
+// when the client has disconnected, but currently does so via an exception.
+static int session_finished(ROMP_Session * session) {
+    // TODO: Detect a disconnection
+    return 0;
+}
+
+// Return a fresh request id.  Ids are never 0, which is reserved for
+// messages that do not expect a reply.
+static REQUEST_ID_T session_next_request_id(ROMP_Session * session) {
+    REQUEST_ID_T request_id = session->next_request_id++;
+    if(request_id == 0) {
+        request_id = session->next_request_id++;
+    }
+    return request_id;
+}
+
+// Decide what to do with a message read while waiting for the reply to
+// request_id.  Return true if it belongs to the caller; otherwise it is kept
+// for whoever is waiting for it, or discarded if nobody ever will be.  A
+// peer that does not know about request ids always replies with id 0; such
+// replies go to the caller, which is right because a call to such a peer
+// keeps the session to itself until its reply is in (see client_call).
+static int session_route_reply(
+        ROMP_Session * session,
+        REQUEST_ID_T request_id,
+        ROMP_Message * message) {
+
+    VALUE id, pending;
+
+    if(message->request_id == request_id || message->request_id == 0) {
+        return 1;
+    }
+
+    id = UINT2NUM(message->request_id);
+    if(RTEST(rb_hash_aref(session->abandoned, id))) {
+        // Anything but a yield is the last message for a request.
+        if(   message->message_type != ROMP_YIELD
+           && message->message_type != ROMP_YIELD_BATCH) {
+            rb_hash_delete(session->abandoned, id);
+        }
+        return 0;
+    }
+
+    pending = rb_hash_aref(session->replies, id);
+    if(NIL_P(pending)) {
+        pending = rb_ary_new();
+        rb_hash_aset(session->replies, id, pending);
+    }
+    rb_ary_push(pending, rb_ary_new3(
+        3,
+        INT2NUM(message->message_type),
+        UINT2NUM(message->object_id),
+        message->message_obj));
+    return 0;
+}
+
+// Take the oldest message kept for request_id, if there is one.
+static int session_take_reply(
+        ROMP_Session * session,
+        REQUEST_ID_T request_id,
+        ROMP_Message * message) {
+
+    VALUE id = UINT2NUM(request_id);
+    VALUE pending = rb_hash_aref(session->replies, id);
+    VALUE reply;
+
+    if(NIL_P(pending)) {
+        return 0;
+    }
+
+    reply = rb_ary_shift(pending);
+    if(RARRAY_LEN(pending) == 0) {
+        rb_hash_delete(session->replies, id);
+    }
+    message->message_type = NUM2INT(RARRAY_PTR(reply)[0]);
+    message->object_id = NUM2UINT(RARRAY_PTR(reply)[1]);
+    message->message_obj = RARRAY_PTR(reply)[2];
+    message->request_id = request_id;
+    message->promise_id = 0;
+    return 1;
+}
+
+// The caller of request_id will not be reading any more replies to it (for
+// example, it broke out of the block it passed); make sure the replies still
+// to come do not pile up in the session.
+static void session_abandon(ROMP_Session * session, REQUEST_ID_T request_id) {
+    VALUE id = UINT2NUM(request_id);
+    VALUE pending = rb_hash_delete(session->replies, id);
+    long j;
+
+    int message_type;
+
+    if(!NIL_P(pending)) {
+        for(j = 0; j < RARRAY_LEN(pending); ++j) {
+            message_type = NUM2INT(RARRAY_PTR(RARRAY_PTR(pending)[j])[0]);
+            if(   message_type != ROMP_YIELD
+               && message_type != ROMP_YIELD_BATCH) {
+                return;
+            }
+        }
+    }
+    rb_hash_aset(session->abandoned, id, Qtrue);
+}
+
+static void session_abandon_dropped(ROMP_Session * session);
+
+// State for session_wait_reply, below.
+typedef struct {
+    ROMP_Session * session;
+    REQUEST_ID_T request_id;
+    ROMP_Message * message;
+    int blocking;
+    int found;
+    int locked;
+    int reader;
+} Reply_Wait;
+
+static void reply_wait_lock(Reply_Wait * wait) {
+    if(!NIL_P(wait->session->reply_mutex)) {
+        ruby_lock(wait->session->reply_mutex);
+    }
+    wait->locked = 1;
+}
+
+static void reply_wait_unlock(Reply_Wait * wait) {
+    wait->locked = 0;
+    if(!NIL_P(wait->session->reply_mutex)) {
+        ruby_unlock(wait->session->reply_mutex);
+    }
+}
+
+// Stop being the session's reader and wake up the other waiting threads so
+// one of them can take over.  The reply mutex must be held.
+static void reply_wait_done_reading(Reply_Wait * wait) {
+    wait->reader = 0;
+    wait->session->reading = 0;
+    if(!NIL_P(wait->session->reply_cond)) {
+        rb_funcall(wait->session->reply_cond, id_broadcast, 0);
+    }
+}
+
+static VALUE reply_wait_read(VALUE ruby_wait) {
+    Reply_Wait * wait = (Reply_Wait *)(ruby_wait);
+    get_message(wait->session, wait->message);
+    return Qnil;
+}
+
+static VALUE reply_wait_loop(VALUE ruby_wait) {
+    Reply_Wait * wait = (Reply_Wait *)(ruby_wait);
+    ROMP_Session * session = wait->session;
+    int status;
+
+    reply_wait_lock(wait);
+    session_abandon_dropped(session);
+    for(;;) {
+        if(session_take_reply(session, wait->request_id, wait->message)) {
+            wait->found = 1;
+            return Qnil;
+        }
+
+        if(session->reading && !NIL_P(session->reply_cond)) {
+            if(!wait->blocking) {
+                return Qnil;
+            }
+            rb_funcall(session->reply_cond, id_wait, 1, session->reply_mutex);
+            continue;
+        }
+
+        if(!wait->blocking && !session_poll_message(session)) {
+            return Qnil;
+        }
+
+        // Nobody is reading, so it is up to us.  Reading must be done
+        // without holding the lock, but the message has to be routed before
+        // we let anyone else start reading.
+        wait->reader = 1;
+        session->reading = 1;
+        reply_wait_unlock(wait);
+        rb_protect(reply_wait_read, ruby_wait, &status);
+        reply_wait_lock(wait);
+        reply_wait_done_reading(wait);
+        if(status) {
+            rb_jump_tag(status);
+        }
+        if(session_route_reply(session, wait->request_id, wait->message)) {
+            wait->found = 1;
+            return Qnil;
+        }
+    }
+}
+
+static VALUE reply_wait_ensure(VALUE ruby_wait) {
+    Reply_Wait * wait = (Reply_Wait *)(ruby_wait);
+
+    if(wait->reader) {
+        if(!wait->locked) {
+            reply_wait_lock(wait);
+        }
+        reply_wait_done_reading(wait);
+    }
+    if(wait->locked) {
+        reply_wait_unlock(wait);
+    }
+    return Qnil;
+}
+
+// Wait for the next message belonging to request_id.  Any number of threads
+// may wait on the same session at once.
+static void session_wait_reply(
+        ROMP_Session * session,
+        REQUEST_ID_T request_id,
+        ROMP_Message * message) {
+
+    Reply_Wait wait = { session, request_id, message, 1, 0, 0, 0 };
+    rb_ensure(
+        reply_wait_loop, (VALUE)(&wait),
+        reply_wait_ensure, (VALUE)(&wait));
+}
+
+// Like session_wait_reply, but only look at what has already arrived.
+// Returns true if a message for request_id was found.
+static int session_poll_reply(
+        ROMP_Session * session,
+        REQUEST_ID_T request_id,
+        ROMP_Message * message) {
+
+    Reply_Wait wait = { session, request_id, message, 0, 0, 0, 0 };
+    rb_ensure(
+        reply_wait_loop, (VALUE)(&wait),
+        reply_wait_ensure, (VALUE)(&wait));
+    return wait.found;
+}
+
+// Wait for a sync response from the server.
+static void wait_sync(ROMP_Session * session, REQUEST_ID_T request_id) {
+    ROMP_Message message;
+
+    // sleep(1);
+    session_wait_reply(session, request_id, &message);
+    if(   message.message_type != ROMP_SYNC
+       && message.object_id != 1
+       && message.message_obj != Qnil) {
+        rb_raise(rb_eRuntimeError, "ROMP synchronization failed");
+    }
+}
+
+// Ask the server to speak the newest protocol version we know.  The server
+// answers with the version to use from now on; a server that predates
+// HELLO answers with an exception, and we stay at version 1.  Nothing else
+// may be sent on the session until this returns.
+static int session_negotiate(ROMP_Session * session) {
+    ROMP_Message message = {
+        ROMP_HELLO,
+        0,
+        INT2NUM(ROMP_PROTOCOL_VERSION),
+        session_next_request_id(session),
+        0
+    };
+
+    send_message(session, &message);
+    session_wait_reply(session, message.request_id, &message);
+    if(message.message_type == ROMP_HELLO) {
+        session_set_version(session, NUM2INT(message.message_obj));
+    }
+    return session->version;
+}
+
+// Answer a HELLO from the client with the protocol version to use, which is
+// the older of the client's and ours.  The answer is sent in the old format;
+// everything after it uses the new one.
+static void reply_hello(ROMP_Session * session, ROMP_Message * message) {
+    int version = NUM2INT(message->message_obj);
+
+    if(version > ROMP_PROTOCOL_VERSION) {
+        version = ROMP_PROTOCOL_VERSION;
+    } else if(version < 1) {
+        version = 1;
+    }
+
+    message->message_type = ROMP_HELLO;
+    message->object_id = 0;
+    message->message_obj = INT2NUM(version);
+    server_send(session, message);
+    session_set_version(session, version);
+}
+
+// Send a reply to a sync request.
+static void reply_sync(ROMP_Session * session, REQUEST_ID_T request_id, int value) {
+    if(value == 0) {
+        ROMP_Message message = { ROMP_SYNC, 1, Qnil, request_id, 0 };
+        server_send(session, &message);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Handle table functions
+// ----------------------------------------------------------------------------
+
+// An object id is a handle into the server's handle table: the low bits
+// are the index of a slot, and the high bits are the slot's generation,
+// which changes every time the slot is reused.  Free slots are reused in
+// the order they were freed, so an id held by a client after its object
+// was unregistered can only refer to whatever object takes the slot next
+// once every free slot has been through all of its generations.
+//
+// An id is 32 bits, of which the index takes ROMP_HANDLE_INDEX_BITS, so at
+// most ROMP_HANDLE_MAX_SLOTS objects (about a million) can be registered at
+// once; the rest of the bits are left for the generation, so that stale
+// ids are caught.  This limit is exported as Session::MAX_ID.
+//
+// Protocol version 1 clients can only address ids below ROMP_MAX_ID_V1, so
+// they are handed the bare index and their ids are looked up without
+// checking the generation (see server_check_reference).
+#define ROMP_HANDLE_INDEX_BITS 20
+#define ROMP_HANDLE_INDEX_MASK ((1UL << ROMP_HANDLE_INDEX_BITS) - 1)
+#define ROMP_HANDLE_MAX_SLOTS  (1UL << ROMP_HANDLE_INDEX_BITS)
+#define ROMP_HANDLE_GENERATIONS (1UL << (32 - ROMP_HANDLE_INDEX_BITS))
+#define ROMP_HANDLE_NONE       ((uint32_t)-1)
+
+// A counted slot holds an object that was registered only so a reference
+// to it could be handed out.  Every reference sent to a client adds to its
+// refcount, and the slot is freed when the clients have released them all.
+typedef struct {
+    VALUE obj;              // Qundef if the slot is free
+    uint32_t generation;
+    uint32_t next_free;
+    uint32_t refcount;
+    int counted;
+} Handle_Slot;
+
+// Free slots are kept on a queue threaded through the slots themselves, so
+// registering and unregistering are both O(1).  ids maps each registered
+// object (by identity) to its id, so an object can be unregistered without
+// searching for it.
+typedef struct {
+    Handle_Slot * slots;
+    uint32_t num_slots;
+    uint32_t capacity;
+    uint32_t free_head;
+    uint32_t free_tail;
+    uint32_t count;         // number of registered objects
+    VALUE ids;              // object's __id__ => handle
+} ROMP_Handle_Table;
+
+static uint32_t handle_make(uint32_t index, uint32_t generation) {
+    return (generation << ROMP_HANDLE_INDEX_BITS) | index;
+}
+
+// Return the slot for a handle, or 0 if the handle is not live.  With
+// any_generation, a bare index names whatever object is in its slot.
+static Handle_Slot * handle_lookup(
+        ROMP_Handle_Table * table, uint32_t handle, int any_generation) {
+
+    uint32_t index = handle & ROMP_HANDLE_INDEX_MASK;
+    Handle_Slot * slot;
+
+    if(index >= table->num_slots) {
+        return 0;
+    }
+    slot = &table->slots[index];
+    if(slot->obj == Qundef) {
+        return 0;
+    }
+    if(any_generation
+       ? handle != index
+       : slot->generation != handle >> ROMP_HANDLE_INDEX_BITS) {
+        return 0;
+    }
+    return slot;
+}
+
+static Handle_Slot * handle_slot(ROMP_Handle_Table * table, uint32_t handle) {
+    return handle_lookup(table, handle, 0);
+}
+
+// Register obj and return its handle.  An object that is already
+// registered keeps the handle it has; it stops being counted if it is
+// registered again without counting (e.g. to bind it to a name).
+static uint32_t handle_register(ROMP_Handle_Table * table, VALUE obj, int counted) {
+    VALUE key = rb_obj_id(obj);
+    VALUE existing = rb_hash_aref(table->ids, key);
+    uint32_t index;
+    Handle_Slot * slot;
+
+    if(!NIL_P(existing)) {
+        if(!counted && (slot = handle_slot(table, NUM2UINT(existing)))) {
+            slot->counted = 0;
+        }
+        return NUM2UINT(existing);
+    }
+
+    if(table->free_head != ROMP_HANDLE_NONE) {
+        index = table->free_head;
+        table->free_head = table->slots[index].next_free;
+        if(table->free_head == ROMP_HANDLE_NONE) {
+            table->free_tail = ROMP_HANDLE_NONE;
+        }
+    } else {
+        if(table->num_slots == ROMP_HANDLE_MAX_SLOTS) {
+            rb_raise(
+                rb_eRuntimeError,
+                "Object limit exceeded (at most %lu objects can be registered at once)",
+                (unsigned long)ROMP_HANDLE_MAX_SLOTS);
+        }
+        if(table->num_slots == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 64;
+            REALLOC_N(table->slots, Handle_Slot, table->capacity);
+        }
+        index = table->num_slots++;
+        table->slots[index].generation = 0;
+    }
+
+    slot = &table->slots[index];
+    slot->obj = obj;
+    slot->next_free = ROMP_HANDLE_NONE;
+    slot->refcount = 0;
+    slot->counted = counted;
+    ++table->count;
+    rb_hash_aset(table->ids, key, UINT2NUM(handle_make(index, slot->generation)));
+    return handle_make(index, slot->generation);
+}
+
+// Unregister obj.  Returns false if it was not registered.
+static int handle_unregister(ROMP_Handle_Table * table, VALUE obj) {
+    VALUE handle = rb_hash_delete(table->ids, rb_obj_id(obj));
+    Handle_Slot * slot;
+    uint32_t index;
+
+    if(NIL_P(handle) || !(slot = handle_slot(table, NUM2UINT(handle)))) {
+        return 0;
+    }
+
+    index = slot - table->slots;
+    slot->obj = Qundef;
+    slot->generation = (slot->generation + 1) % ROMP_HANDLE_GENERATIONS;
+    slot->next_free = ROMP_HANDLE_NONE;
+    if(table->free_tail == ROMP_HANDLE_NONE) {
+        table->free_head = index;
+    } else {
+        table->slots[table->free_tail].next_free = index;
+    }
+    table->free_tail = index;
+    --table->count;
+    return 1;
+}
+
+// Unregister obj if it is still registered under handle: it may have been
+// unregistered, and then registered again by someone else, since.  A
+// counted object stays registered while any client holds a reference.
+static int handle_unregister_scoped(
+        ROMP_Handle_Table * table, VALUE obj, uint32_t handle) {
+
+    VALUE existing = rb_hash_aref(table->ids, rb_obj_id(obj));
+    Handle_Slot * slot;
+
+    if(NIL_P(existing) || NUM2UINT(existing) != handle) {
+        return 0;
+    }
+    slot = handle_slot(table, handle);
+    if(slot && slot->counted && slot->refcount != 0) {
+        return 0;
+    }
+    return handle_unregister(table, obj);
+}
+
+// Note that another reference to a counted object has been handed out.
+static void handle_retain(ROMP_Handle_Table * table, uint32_t handle) {
+    Handle_Slot * slot = handle_slot(table, handle);
+    if(slot && slot->counted) {
+        ++slot->refcount;
+    }
+}
+
+// Drop count references to a counted object, unregistering it when none
+// are left.  Stale handles are ignored.
+static void handle_release(ROMP_Handle_Table * table, uint32_t handle, uint32_t count) {
+    Handle_Slot * slot = handle_slot(table, handle);
+    if(!slot || !slot->counted) {
+        return;
+    }
+    if(count >= slot->refcount) {
+        handle_unregister(table, slot->obj);
+    } else {
+        slot->refcount -= count;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Server functions
+// ----------------------------------------------------------------------------
+
+// We use this structure to pass data to our exception handler.  This is done
+// by casting a pointer to a Ruby VALUE... not 100% kosher, but it should work.
+// Replies are built in the request's own message, so they carry its request
+// id back to the client.
+typedef struct {
+    ROMP_Session * session;
+    ROMP_Message * message;
+    VALUE obj;
+    int debug;
+    VALUE resolve_server;
+    int refcount;       // count the references handed out (see RELEASE)
+
+    // Values yielded to the client but not yet sent (see server_send_yield).
+    VALUE yields;
+    size_t yield_bytes;
+    struct timeval yield_time;
+
+    // How many more values may be yielded before the client must grant
+    // more credit, or -1 if the call is not flow controlled.
+    long credits;
+
+    // The Server and the Session object, for parking a streamed call that
+    // has run out of credit (see server_park).  parked is set once the
+    // call has been.
+    VALUE server;
+    VALUE ruby_session;
+    int parked;
+} Server_Info;
+
+static void server_process_message(Server_Info * server_info, VALUE resolve_server);
+
+// Make a method call into a Ruby object.
+static VALUE server_funcall(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    return ruby_send(server_info->obj, server_info->message->message_obj);
+}
+
+// A client speaking protocol version 1 can only address objects with
+// 16-bit ids, so make sure it is never handed a reference it cannot use.
+// Besides Object_References, that includes the plain ids returned by the
+// resolve object (object 0).  Returns the value to send, which carries
+// only the index of the object's slot (see ROMP_HANDLE_INDEX_BITS).
+static VALUE server_check_reference(Server_Info * server_info, VALUE value) {
+    VALUE object_id;
+    uint32_t handle;
+
+    if(server_info->session->version >= 2) {
+        return value;
+    }
+
+    if(CLASS_OF(value) == rb_cObject_Reference) {
+        object_id = rb_funcall(value, id_object_id, 0);
+    } else if(   server_info->message->object_id == 0
+              && server_info->message->message_type != ROMP_PIPELINE
+              && rb_obj_is_kind_of(value, rb_cInteger)) {
+        object_id = value;
+    } else {
+        return value;
+    }
+
+    handle = NUM2UINT(object_id);
+    if((handle & ROMP_HANDLE_INDEX_MASK) >= ROMP_MAX_ID_V1) {
+        rb_raise(
+            rb_eRangeError,
+            "Object id too large for a protocol version 1 client");
+    }
+    if(handle == (handle & ROMP_HANDLE_INDEX_MASK)) {
+        return value;
+    }
+    object_id = UINT2NUM(handle & ROMP_HANDLE_INDEX_MASK);
+    if(rb_obj_is_kind_of(value, rb_cInteger)) {
+        return object_id;
+    }
+    return rb_class_new_instance(1, &object_id, rb_cObject_Reference);
+}
+
+// Add count to the number of references to handle the session's client
+// holds (see ROMP_Session).  A count below zero takes away at most what
+// the client holds.
+static void server_count_handed(ROMP_Session * session, VALUE handle, long count) {
+    VALUE held;
+
+    if(NIL_P(session->handed)) {
+        session->handed = rb_hash_new();
+    }
+    held = rb_hash_aref(session->handed, handle);
+    count += NIL_P(held) ? 0 : NUM2LONG(held);
+    if(count > 0) {
+        rb_hash_aset(session->handed, handle, LONG2NUM(count));
+    } else if(!NIL_P(held)) {
+        rb_hash_delete(session->handed, handle);
+    }
+}
+
+// When reference counting is on, each reference handed to a client keeps
+// its object registered until the client sends it back in a RELEASE.
+static void server_retain_reference(Server_Info * server_info, VALUE value) {
+    VALUE handle;
+
+    if(server_info->refcount && CLASS_OF(value) == rb_cObject_Reference) {
+        handle = rb_funcall(value, id_object_id, 0);
+        rb_funcall(server_info->resolve_server, id_retain, 1, handle);
+        server_count_handed(server_info->session, handle, 1);
+    }
+}
+
+// Release the references listed in a RELEASE message.
+static VALUE server_release(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    VALUE counts = server_info->message->message_obj;
+    long j;
+
+    Check_Type(counts, T_ARRAY);
+    for(j = 0; j + 1 < RARRAY_LEN(counts); j += 2) {
+        server_count_handed(
+            server_info->session,
+            RARRAY_PTR(counts)[j],
+            -NUM2LONG(RARRAY_PTR(counts)[j + 1]));
+    }
+    return rb_funcall(
+        server_info->resolve_server,
+        id_release,
+        1,
+        server_info->message->message_obj);
+}
+
+// Send the values yielded so far to the client, unless the flusher thread
+// has already (see server_send_yield).
+static VALUE server_flush_yields(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    VALUE yields = server_info->yields;
+
+    if(NIL_P(yields)) {
+        return Qnil;
+    }
+    server_info->yields = Qnil;
+    server_send_yields(
+        server_info->session, yields, server_info->message->request_id);
+    return Qnil;
+}
+
+// Start streaming a call with a block, if the client granted it credit.
+// The credit of each call being streamed is kept in the session's credits
+// hash, so any number of them can be waiting for more at once (see
+// server_wait_credit).
+static void server_open_stream(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+    VALUE id = UINT2NUM(server_info->message->request_id);
+    VALUE credit;
+
+    server_info->credits = -1;
+    if(NIL_P(session->credits)) {
+        return;
+    }
+    credit = rb_hash_aref(session->credits, id);
+    if(!NIL_P(credit)) {
+        server_info->credits = NUM2LONG(credit);
+        rb_hash_aset(session->credits, id, INT2FIX(0));
+    }
+}
+
+static VALUE server_credit_update(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    ROMP_Session * session = server_info->session;
+    VALUE id = UINT2NUM(server_info->message->request_id);
+    VALUE credit;
+
+    if(NIL_P(session->credits)) {
+        session->credits = rb_hash_new();
+    }
+
+    switch(server_info->message->object_id) {
+        case ROMP_CREDIT_OPEN:
+            rb_hash_aset(
+                session->credits, id, server_info->message->message_obj);
+            break;
+
+        case ROMP_CREDIT_MORE:
+            credit = rb_hash_aref(session->credits, id);
+            if(!NIL_P(credit)) {
+                rb_hash_aset(
+                    session->credits,
+                    id,
+                    LONG2NUM(NUM2LONG(credit) +
+                             NUM2LONG(server_info->message->message_obj)));
+            }
+            break;
+
+        case ROMP_CREDIT_CANCEL:
+            rb_hash_delete(session->credits, id);
+            break;
+    }
+
+    if(!NIL_P(session->stream_cond)) {
+        rb_funcall(session->stream_cond, id_broadcast, 0);
+    }
+    return Qnil;
+}
+
+// Handle a CREDIT message from the client, waking up any parked calls so
+// they can see whether it was for them.  Credit for a call that is not
+// (or no longer) being streamed is dropped.
+static void server_credit(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+    VALUE ruby_server_info = (VALUE)(server_info);
+
+    if(NIL_P(session->stream_mutex)) {
+        server_credit_update(ruby_server_info);
+        return;
+    }
+    ruby_lock(session->stream_mutex);
+    rb_ensure(
+        server_credit_update, ruby_server_info,
+        ruby_unlock, session->stream_mutex);
+}
+
+// Take the credit the client has granted the call being streamed since it
+// last looked, if any.  Returns false if there is none yet.  If the client
+// has cancelled the call, raise, which ends the method the values were
+// being yielded from.
+static int server_take_credit(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+    VALUE id = UINT2NUM(server_info->message->request_id);
+    VALUE credit = NIL_P(session->credits)
+        ? Qnil
+        : rb_hash_aref(session->credits, id);
+
+    if(NIL_P(credit)) {
+        rb_raise(rb_eRuntimeError, "Call cancelled by the client");
+    }
+    if(NUM2LONG(credit) <= 0) {
+        return 0;
+    }
+    server_info->credits = NUM2LONG(credit);
+    rb_hash_aset(session->credits, id, INT2FIX(0));
+    return 1;
+}
+
+// Park the call being streamed (see ROMP_Session): hand the session to
+// another thread, by way of the Server's park method, so the messages the
+// client sends while the call waits for credit are served there.  The
+// thread the call is running on finishes the call, and then does nothing
+// more with the session.
+static void server_park(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+
+    if(server_info->parked) {
+        return;
+    }
+    server_init_locks(session);
+    ++session->parked;
+    server_info->parked = 1;
+    rb_funcall(server_info->server, id_park, 1, server_info->ruby_session);
+}
+
+static VALUE server_wait_parked(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    ROMP_Session * session = server_info->session;
+
+    while(!server_take_credit(server_info)) {
+        rb_funcall(session->stream_cond, id_wait, 1, session->stream_mutex);
+    }
+    return Qnil;
+}
+
+// The call being streamed has used up its credit: wait for the client to
+// grant more.  Whatever else the client sends in the meantime is served
+// as usual (the client may well be waiting on it before it takes any more
+// values), but on another thread: the call is parked, and this thread just
+// waits for the credit.  So any number of calls on a session can wait at
+// once, and each goes on as soon as its own credit comes in.
+static void server_wait_credit(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+
+    if(server_take_credit(server_info)) {
+        return;
+    }
+    server_park(server_info);
+    ruby_lock(session->stream_mutex);
+    rb_ensure(
+        server_wait_parked, (VALUE)(server_info),
+        ruby_unlock, session->stream_mutex);
+}
+
+// Return roughly how much a yielded value adds to a batch.
+static size_t yield_size(VALUE value) {
+    return TYPE(value) == T_STRING ? (size_t)RSTRING_LEN(value) + 8 : 8;
+}
+
+// Start a new batch of yielded values.  It is pushed onto the session's
+// yield queue too, so that if it is still waiting once
+// ROMP_YIELD_BATCH_USEC have passed, the Server's flusher thread sends it
+// (see Session#flush_yields).
+static void server_start_batch(Server_Info * server_info, struct timeval * now) {
+    ROMP_Session * session = server_info->session;
+
+    server_info->yields = rb_ary_new();
+    server_info->yield_bytes = 0;
+    server_info->yield_time = *now;
+    if(NIL_P(session->yield_queue)) {
+        return;
+    }
+    server_init_locks(session);
+    rb_funcall(
+        session->yield_queue,
+        id_push,
+        1,
+        rb_ary_new3(
+            4,
+            server_info->ruby_session,
+            server_info->yields,
+            UINT2NUM(server_info->message->request_id),
+            rb_float_new(now->tv_sec + now->tv_usec / 1e6)));
+}
+
+// Send a yield message to the client, indicating that it should call
+// Kernel#yield with the message that is sent.  Since protocol version 5,
+// a session with a yield_batch greater than 1 collects yielded values and
+// sends them several at a time in a YIELD_BATCH, until the batch is full
+// or its first value has been waiting for ROMP_YIELD_BATCH_USEC; whatever
+// is left goes out before the reply.  The Server's flusher thread keeps
+// that deadline even while the method is busy with something else
+// between yields.  Batching is still off unless the server asks for it,
+// since it only pays for methods that yield in quick succession.
+// A batch never holds more values than the client has credit for, and the
+// method waits here once the credit has run out.
+static VALUE server_send_yield(VALUE retval, VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    ROMP_Session * session = server_info->session;
+    struct timeval now;
+    long usec;
+
+    VALUE sent = server_check_reference(server_info, retval);
+    server_retain_reference(server_info, retval);
+    retval = sent;
+
+    if(session->version < 5 || session->yield_batch <= 1) {
+        server_info->message->message_type = ROMP_YIELD;
+        server_info->message->object_id = 0;
+        server_info->message->message_obj = retval;
+        server_send(session, server_info->message);
+        if(server_info->credits > 0 && --server_info->credits == 0) {
+            server_wait_credit(server_info);
+        }
+        return Qnil;
+    }
+
+    // (An empty batch has been sent by the flusher thread.)
+    gettimeofday(&now, 0);
+    if(NIL_P(server_info->yields) || RARRAY_LEN(server_info->yields) == 0) {
+        server_start_batch(server_info, &now);
+    }
+    rb_ary_push(server_info->yields, retval);
+    server_info->yield_bytes += yield_size(retval);
+    if(server_info->credits > 0) {
+        --server_info->credits;
+    }
+
+    usec = (now.tv_sec - server_info->yield_time.tv_sec) * 1000000
+         + (now.tv_usec - server_info->yield_time.tv_usec);
+    if(   RARRAY_LEN(server_info->yields) >= session->yield_batch
+       || server_info->yield_bytes >= ROMP_YIELD_BATCH_BYTES
+       || usec >= ROMP_YIELD_BATCH_USEC
+       || server_info->credits == 0) {
+        server_flush_yields(ruby_server_info);
+    }
+    if(server_info->credits == 0) {
+        server_wait_credit(server_info);
+    }
+
+    return Qnil;
+}
+
+#ifdef HAVE_RB_BLOCK_CALL
+
+// The block passed to the server object when the client calls a method with
+// a block.  Multiple yielded values are sent as an Array, which is how
+// rb_iterate used to pass them to server_send_yield.
+static VALUE server_block_yield(RB_BLOCK_CALL_FUNC_ARGLIST(retval, ruby_server_info)) {
+    if(argc > 1) {
+        retval = rb_ary_new4(argc, argv);
+    }
+    return server_send_yield(retval, ruby_server_info);
+}
+
+#endif
+
+// Send a return value to the client, indicating that it should return
+// the message to the caller.
+static VALUE server_send_retval(VALUE retval, VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    VALUE sent;
+
+    server_flush_yields(ruby_server_info);
+    sent = server_check_reference(server_info, retval);
+    server_retain_reference(server_info, retval);
+    retval = sent;
+    server_info->message->message_type = ROMP_RETVAL;
+    server_info->message->object_id = 0;
+    server_info->message->message_obj = retval;
+    server_send(server_info->session, server_info->message);
+
+    return Qnil;
+}
+
+// Send an exception the client, indicating that it should raise an exception.
+static VALUE server_exception(VALUE ruby_server_info, VALUE exc) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    VALUE caller = ruby_caller();
+    VALUE bt = ruby_exc_backtrace(exc);
+    int status;
+
+    // The values yielded before the exception still go out first, if they
+    // can; if sending them is what failed, they are dropped.
+    rb_protect(server_flush_yields, ruby_server_info, &status);
+#ifdef HAVE_RB_SET_ERRINFO
+    if(status) {
+        rb_set_errinfo(Qnil);
+    }
+#endif
+    server_info->yields = Qnil;
+
+    server_info->message->message_type = ROMP_EXCEPTION;
+    server_info->message->object_id = 0;
+    server_info->message->message_obj = exc;
+
+    // Get rid of extraneous caller information to make debugging easier.
+    ruby_slice_bang(bt, RARRAY_LEN(bt) - RARRAY_LEN(caller) - 1, -1);
+
+    // If debugging is enabled, then print an exception.
+    if(server_info->debug) {
+        ruby_print_exception(exc);
+    }
+
+    server_send(server_info->session, server_info->message);
+
+    return Qnil;
+}
+
+// Remember the result of a request if it is a remote object, in case the
+// client sends PIPELINE requests aimed at it.
+static void server_keep_promise(Server_Info * server_info, VALUE retval) {
+    ROMP_Session * session = server_info->session;
+    REQUEST_ID_T request_id = server_info->message->request_id;
+
+    if(request_id == 0 || CLASS_OF(retval) != rb_cObject_Reference) {
+        return;
+    }
+    if(NIL_P(session->promises)) {
+        session->promises = rb_ary_new2(ROMP_PROMISE_SLOTS);
+    }
+    rb_ary_store(
+        session->promises,
+        request_id % ROMP_PROMISE_SLOTS,
+        rb_ary_new3(2, UINT2NUM(request_id), retval));
+}
+
+// Find the object a PIPELINE request is aimed at: the remote object that
+// was returned by an earlier request on the same session.  Requests on a
+// session are handled in order, so that request has already been answered.
+static VALUE server_promised_object(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+    REQUEST_ID_T promise_id = server_info->message->promise_id;
+    VALUE entry = Qnil;
+
+    if(!NIL_P(session->promises)) {
+        entry = rb_ary_entry(session->promises, promise_id % ROMP_PROMISE_SLOTS);
+    }
+    if(NIL_P(entry) || NUM2UINT(RARRAY_PTR(entry)[0]) != promise_id) {
+        rb_raise(
+            rb_eRuntimeError,
+            "Request %lu did not return a remote object",
+            (unsigned long)promise_id);
+    }
+
+    return ruby_get_object(
+        server_info->obj,
+        NUM2UINT(rb_funcall(RARRAY_PTR(entry)[1], id_object_id, 0)));
+}
+
+// Put the method name back at the start of a request from a client that
+// interns method names: the client sends either the id of a name it has
+// told us before, or [id, name] to tell us.
+static void server_method_name(Server_Info * server_info) {
+    ROMP_Session * session = server_info->session;
+    VALUE message = server_info->message->message_obj;
+    VALUE method, name;
+    long method_id;
+
+    switch(server_info->message->message_type) {
+        case ROMP_REQUEST:
+        case ROMP_REQUEST_BLOCK:
+        case ROMP_ONEWAY:
+        case ROMP_ONEWAY_SYNC:
+        case ROMP_PIPELINE:
+            break;
+        default:
+            return;
+    }
+    if(   session->version < 3
+       || TYPE(message) != T_ARRAY
+       || RARRAY_LEN(message) == 0) {
+        return;
+    }
+
+    method = RARRAY_PTR(message)[0];
+    if(FIXNUM_P(method)) {
+        method_id = FIX2LONG(method);
+        name = NIL_P(session->methods) || method_id < 0
+            ? Qnil
+            : rb_ary_entry(session->methods, method_id);
+        if(NIL_P(name)) {
+            rb_raise(rb_eRuntimeError, "Unknown method id %ld", method_id);
+        }
+    } else if(TYPE(method) == T_ARRAY && RARRAY_LEN(method) == 2) {
+        method_id = NUM2LONG(RARRAY_PTR(method)[0]);
+        name = RARRAY_PTR(method)[1];
+        if(method_id < 0 || method_id >= ROMP_MAX_METHODS || !SYMBOL_P(name)) {
+            rb_raise(rb_eRuntimeError, "Bad method id %ld", method_id);
+        }
+        if(NIL_P(session->methods)) {
+            session->methods = rb_ary_new();
+        }
+        rb_ary_store(session->methods, method_id, name);
+    } else {
+        return;
+    }
+
+    rb_ary_store(message, 0, name);
+}
+
+// A method called without a block may return an Enumerator, which cannot
+// be sent to the client as it is.  From protocol version 7 on, it is kept
+// on the server behind a cursor instead, and the client fetches its values
+// from there as they are needed.
+static VALUE server_cursor(Server_Info * server_info, VALUE retval) {
+    if(   server_info->session->version < 7
+       || NIL_P(rb_cEnumerator_Class)
+       || !rb_obj_is_kind_of(retval, rb_cEnumerator_Class)) {
+        return retval;
+    }
+    retval = rb_funcall(server_info->resolve_server, id_create_cursor, 1, retval);
+    server_count_handed(
+        server_info->session, rb_funcall(retval, id_object_id, 0), 1);
+    return retval;
+}
+
+// Proces a request from the client and send an appropriate reply.
+static VALUE server_reply(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    ROMP_Message message = { ROMP_NULL_MSG, 0, Qnil, 0, 0 };
+    VALUE retval;
+    int status;
+
+    server_method_name(server_info);
+
+    if(server_info->message->message_type == ROMP_PIPELINE) {
+        server_info->obj = server_promised_object(server_info);
+        server_info->message->promise_id = 0;
+    } else if(server_info->session->version < 2) {
+        // (A version 1 client only knows the index of an object's slot.)
+        server_info->obj = rb_funcall(
+            server_info->obj,
+            id_get_object,
+            2,
+            UINT2NUM(server_info->message->object_id),
+            Qtrue);
+    } else if(server_info->message->message_type != ROMP_CREDIT) {
+        // (The object id of a CREDIT message says what kind it is.)
+        server_info->obj = ruby_get_object(
+            server_info->obj,
+            server_info->message->object_id);
+    }
+
+    // TODO: The client should be able to pass a callback object to the server;
+    // msg_to_obj can create a Proxy_Object, but it needs a session to make
+    // calls over.
+
+    // Perform the appropriate action based on message type.
+    switch(server_info->message->message_type) {
+        case ROMP_ONEWAY_SYNC:
+            message.message_type = ROMP_NULL_MSG;
+            message.request_id = server_info->message->request_id;
+            server_send(server_info->session, &message);
+            // fallthrough
+ 
+        case ROMP_ONEWAY:
+            rb_protect(server_funcall, ruby_server_info, &status);
+            return Qnil;
+
+        case ROMP_REQUEST:
+        case ROMP_PIPELINE:
+            retval = ruby_send(
+                server_info->obj,
+                server_info->message->message_obj);
+            retval = server_cursor(server_info, retval);
+            break;
 
         case ROMP_REQUEST_BLOCK:
+            server_open_stream(server_info);
+#ifdef HAVE_RB_BLOCK_CALL
+            // Since 1.9, rb_iterate no longer passes its block on to a
+            // method called with rb_apply (nor does send, when it is called
+            // with rb_block_call), so call the method directly.
+            retval = rb_block_call(
+                server_info->obj,
+                rb_to_id(RARRAY_PTR(server_info->message->message_obj)[0]),
+                RARRAY_LEN(server_info->message->message_obj) - 1,
+                RARRAY_PTR(server_info->message->message_obj) + 1,
+                server_block_yield, ruby_server_info);
+#else
             retval = rb_iterate(
                 server_funcall, ruby_server_info,
                 server_send_yield, ruby_server_info);
+#endif
             break;
  
         case ROMP_SYNC:
             reply_sync(
                 server_info->session,
+                server_info->message->request_id,
                 server_info->message->object_id);
             return Qnil;
 
-        default:
-            rb_raise(rb_eRuntimeError, "Bad session request");
+        case ROMP_HELLO:
+            reply_hello(server_info->session, server_info->message);
+            return Qnil;
+
+        case ROMP_RELEASE:
+            rb_protect(server_release, ruby_server_info, &status);
+            return Qnil;
+
+        case ROMP_CREDIT:
+            server_credit(server_info);
+            return Qnil;
+
+        default:
+            rb_raise(rb_eRuntimeError, "Bad session request");
+    }
+
+    server_keep_promise(server_info, retval);
+    server_send_retval(retval, ruby_server_info);
+
+    return Qnil;
+}
+
+// Process a single message from the client, route it to the appropriate
+// object, and send a response.
+static void server_process_message(Server_Info * server_info, VALUE resolve_server) {
+    VALUE ruby_server_info = (VALUE)(server_info);
+    ROMP_Session * session = server_info->session;
+    int block;
+
+    get_message(session, server_info->message);
+    block = server_info->message->message_type == ROMP_REQUEST_BLOCK;
+    rb_rescue2(
+        server_reply, ruby_server_info,
+        server_exception, ruby_server_info, rb_eException, 0);
+    server_info->obj = resolve_server;
+
+    // Whatever happened to the call, it gets no more credit.
+    if(block && !NIL_P(session->credits)) {
+        rb_hash_delete(
+            session->credits, UINT2NUM(server_info->message->request_id));
+        server_info->credits = -1;
+    }
+}
+
+static VALUE server_process(VALUE ruby_server_info) {
+    Server_Info * server_info = (Server_Info *)(ruby_server_info);
+    server_process_message(server_info, server_info->resolve_server);
+    return Qnil;
+}
+
+// Process a single message from the client (see server_process_message).
+// Returns true if it was a streamed call that got parked (see server_park),
+// in which case the session belongs to another thread now; whatever went
+// wrong with it after that is for that thread to find out.
+static int server_serve_message(Server_Info * server_info) {
+    int status;
+
+    rb_protect(server_process, (VALUE)(server_info), &status);
+    if(server_info->parked) {
+        --server_info->session->parked;
+#ifdef HAVE_RB_SET_ERRINFO
+        if(status) {
+            rb_set_errinfo(Qnil);
+        }
+#endif
+        return 1;
+    }
+    if(status) {
+        rb_jump_tag(status);
+    }
+    return 0;
+}
+
+// The main server loop.  Wait for a message from the client, route the
+// message to the appropriate object, send a response and repeat.  Returns
+// true if a streamed call that ran out of credit was parked (see
+// server_park), in which case another thread has taken over the loop.
+static int server_loop(
+        ROMP_Session * session, VALUE resolve_server, int dbg, int refcount,
+        VALUE server, VALUE ruby_session) {
+    ROMP_Message message;
+    Server_Info server_info =
+        { session, &message, resolve_server, dbg, resolve_server, refcount,
+          Qnil, 0, { 0, 0 }, -1, server, ruby_session, 0 };
+
+    while(!session_finished(session)) {
+        if(server_serve_message(&server_info)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Process every message that has already arrived in full on a session,
+// then return so the worker thread can serve other sessions.  There is
+// always at least one message (or a pending disconnect) to handle when the
+// reactor hands us a session.  A message that is only partly here is left
+// for the reactor to finish gathering, so a peer that stops in the middle
+// of one cannot hold on to the worker.  A streamed call that runs out of
+// credit is parked (see server_park) rather than holding on to the worker
+// either; returns true if that happened, in which case the session has
+// been handed to another worker.
+static int server_dispatch(
+        ROMP_Session * session, VALUE resolve_server, int dbg, int refcount,
+        VALUE server, VALUE ruby_session) {
+    ROMP_Message message;
+    Server_Info server_info =
+        { session, &message, resolve_server, dbg, resolve_server, refcount,
+          Qnil, 0, { 0, 0 }, -1, server, ruby_session, 0 };
+
+    do {
+        if(server_serve_message(&server_info)) {
+            return 1;
+        }
+    } while(session_poll_message(session));
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Reactor functions
+// ----------------------------------------------------------------------------
+
+#define ROMP_REACTOR_MAX_EVENTS 64
+
+// A reactor watches many sessions with a single epoll descriptor.  Each
+// session is registered one-shot: once the reactor hands it to a worker,
+// it is not reported again until the worker rearms it, so only one thread
+// at a time ever reads from (or replies on) a given session.  About every
+// ROMP_FRAME_IDLE milliseconds the reactor also trims the frame buffers of
+// the sessions that no worker has and that have gone quiet.
+typedef struct {
+    int epoll_fd;
+    VALUE sessions; // fd => session; keeps registered sessions alive
+    struct timeval swept;   // when frame buffers were last trimmed
+} ROMP_Reactor;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+// Add or re-enable a session in the reactor's epoll set.  This may run
+// without the interpreter lock; it returns 0 or -1 with errno set.
+static int reactor_watch(ROMP_Reactor * reactor, ROMP_Session * session, int op) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = session;
+    return epoll_ctl(reactor->epoll_fd, op, session->read_fd, &event);
+}
+
+// Arguments for reactor_poll, below.
+typedef struct {
+    ROMP_Reactor * reactor;
+    struct epoll_event events[ROMP_REACTOR_MAX_EVENTS];
+    int ready_fds[ROMP_REACTOR_MAX_EVENTS];
+    int num_ready;
+    int error;
+} Reactor_Poll;
+
+// Wait for events on the reactor's sessions and read whatever has arrived
+// into their read-ahead buffers.  Sessions that now hold a complete message
+// (or have been disconnected) are reported by fd in ready_fds, and so are
+// those with a message too large for the read-ahead buffer, which the
+// caller gathers (see reactor_wait); sessions that woke up with only part
+// of a small message are quietly rearmed.  This runs without the
+// interpreter lock when possible, so it only deals with the C side of each
+// session; the caller maps fds back to Session objects.
+static void * reactor_poll(void * ptr) {
+    Reactor_Poll * poll_args = (Reactor_Poll *)ptr;
+    ROMP_Session * session;
+    ssize_t read_count;
+    int timeout;
+    int n, j;
+
+#ifdef ROMP_RELEASE_GVL
+    timeout = ROMP_FRAME_IDLE;
+#else
+    timeout = 0;
+#endif
+
+    poll_args->num_ready = 0;
+    n = epoll_wait(
+        poll_args->reactor->epoll_fd,
+        poll_args->events,
+        ROMP_REACTOR_MAX_EVENTS,
+        timeout);
+    if(n == -1) {
+        poll_args->error = errno;
+        return 0;
+    }
+
+    for(j = 0; j < n; ++j) {
+        session = (ROMP_Session *)poll_args->events[j].data.ptr;
+
+        if(session->partial) {
+            // (The rest of the message goes straight into the frame buffer.)
+            poll_args->ready_fds[poll_args->num_ready++] = session->read_fd;
+            continue;
+        }
+
+        read_count = session_read_available(session);
+        if(   read_count == 0
+           || (read_count == -1 && errno != EWOULDBLOCK)
+           || session_has_message(session)
+           || reactor_watch(poll_args->reactor, session, EPOLL_CTL_MOD) == -1) {
+            poll_args->ready_fds[poll_args->num_ready++] = session->read_fd;
+        }
+    }
+
+    poll_args->error = 0;
+    return 0;
+}
+
+static int reactor_sweep_session(VALUE fd, VALUE ruby_session, VALUE arg) {
+    ROMP_Session * session;
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+
+    if(!session->dispatched) {
+        if(!session->partial) {
+            frame_idle(&session->input);
+        }
+        if(!session->parked) {
+            frame_idle(&session->output);
+        }
+    }
+    return ST_CONTINUE;
+}
+
+// Trim the frame buffers of quiet sessions (see frame_idle) if it has been
+// ROMP_FRAME_IDLE milliseconds since the last time.  Sessions a worker has
+// are skipped; the worker may be using their buffers.  So is the input
+// buffer of a session a large message is being gathered in, and the
+// output buffer of a session with parked calls, which may be writing.  (Without a way to
+// release the interpreter lock, the reactor only wakes up for traffic, so
+// if every session goes quiet at once, nothing is trimmed until one of
+// them wakes up again.)
+static void reactor_sweep(ROMP_Reactor * reactor) {
+    struct timeval now;
+    long msec;
+
+    gettimeofday(&now, 0);
+    msec = (now.tv_sec - reactor->swept.tv_sec) * 1000
+         + (now.tv_usec - reactor->swept.tv_usec) / 1000;
+    if(msec < ROMP_FRAME_IDLE) {
+        return;
+    }
+    reactor->swept = now;
+    rb_hash_foreach(reactor->sessions, reactor_sweep_session, Qnil);
+}
+
+// Wait until at least one session has a complete message buffered (or has
+// been disconnected) and return all such sessions.  A message too large for
+// the read-ahead buffer is gathered here, without blocking, as it arrives
+// (it needs the interpreter lock to grow the frame buffer); its session is
+// only returned once all of it is in, and is rearmed until then.
+static VALUE reactor_wait(ROMP_Reactor * reactor) {
+    Reactor_Poll poll_args;
+    VALUE ready = rb_ary_new();
+    VALUE ruby_session;
+    ROMP_Session * session;
+    int j;
+
+    poll_args.reactor = reactor;
+
+    while(RARRAY_LEN(ready) == 0) {
+#ifdef ROMP_RELEASE_GVL
+        rb_thread_call_without_gvl(reactor_poll, &poll_args, RUBY_UBF_IO, 0);
+#else
+        // The epoll descriptor itself becomes readable when any of the
+        // sessions it watches is; let the interpreter wait on it so other
+        // threads keep running.
+        rb_thread_wait_fd(reactor->epoll_fd);
+        reactor_poll(&poll_args);
+#endif
+
+        if(poll_args.error == EINTR) {
+#ifdef ROMP_RELEASE_GVL
+            rb_thread_check_ints();
+#endif
+            continue;
+        } else if(poll_args.error != 0) {
+            errno = poll_args.error;
+            rb_sys_fail("epoll_wait");
+        }
+
+        for(j = 0; j < poll_args.num_ready; ++j) {
+            ruby_session = rb_hash_aref(
+                reactor->sessions, INT2NUM(poll_args.ready_fds[j]));
+            Data_Get_Struct(ruby_session, ROMP_Session, session);
+            if(   !session_poll_message(session)
+               && reactor_watch(reactor, session, EPOLL_CTL_MOD) == 0) {
+                continue;
+            }
+            session->dispatched = 1;
+            rb_ary_push(ready, ruby_session);
+        }
+
+        reactor_sweep(reactor);
+    }
+
+    return ready;
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Release queue functions
+// ----------------------------------------------------------------------------
+
+static ROMP_Release_Queue * release_queue_new(void) {
+    ROMP_Release_Queue * queue = ALLOC(ROMP_Release_Queue);
+    queue->refcount = 1;
+    queue->entries = 0;
+    queue->len = 0;
+    queue->capacity = 0;
+    return queue;
+}
+
+static void release_queue_unref(ROMP_Release_Queue * queue) {
+    if(--queue->refcount == 0) {
+        free(queue->entries);
+        xfree(queue);
     }
+}
 
-    server_send_retval(retval, ruby_server_info);
+// Queue count references to object_id for release.  This is called from a
+// free function, so it must not allocate Ruby memory or raise; if memory
+// runs out, the references are simply never released.
+static void release_queue_push(
+        ROMP_Release_Queue * queue, OBJECT_ID_T object_id, uint32_t count) {
+    uint32_t * entries;
+    size_t capacity;
 
-    return Qnil;
+    if(queue->len + 2 > queue->capacity) {
+        capacity = queue->capacity ? queue->capacity * 2 : 64;
+        entries = realloc(queue->entries, capacity * sizeof(uint32_t));
+        if(!entries) {
+            return;
+        }
+        queue->entries = entries;
+        queue->capacity = capacity;
+    }
+    queue->entries[queue->len++] = object_id;
+    queue->entries[queue->len++] = count;
 }
 
-// The main server loop.  Wait for a message from the client, route the
-// message to the appropriate object, send a response and repeat.
-static void server_loop(ROMP_Session * session, VALUE resolve_server, int dbg) {
-    ROMP_Message message;
-    Server_Info server_info = { session, &message, resolve_server, dbg };
-    VALUE ruby_server_info = (VALUE)(&server_info);
+// Empty the queue, returning its contents as an Array, or nil if there was
+// nothing in it.  The entries are detached before any Ruby objects are
+// created, since creating them can run the collector and refill the queue.
+static VALUE release_queue_take(ROMP_Release_Queue * queue) {
+    uint32_t * entries = queue->entries;
+    size_t len = queue->len;
+    size_t j;
+    VALUE counts;
 
-    while(!session_finished(session)) {
-        get_message(session, &message);
-        rb_rescue2(
-            server_reply, ruby_server_info,
-            server_exception, ruby_server_info, rb_eException, 0);
-        server_info.obj = resolve_server;
+    if(len == 0) {
+        return Qnil;
+    }
+    queue->entries = 0;
+    queue->len = 0;
+    queue->capacity = 0;
+
+    counts = rb_ary_new2(len);
+    for(j = 0; j < len; ++j) {
+        rb_ary_push(counts, UINT2NUM(entries[j]));
+    }
+    free(entries);
+    return counts;
+}
+
+// Abandon the requests of the Futures that were collected without their
+// reply having been picked up.  Must be called with the reply mutex held.
+static void session_abandon_dropped(ROMP_Session * session) {
+    ROMP_Release_Queue * queue = session->dropped;
+    uint32_t * entries = queue->entries;
+    size_t len = queue->len;
+    size_t j;
+
+    if(len == 0) {
+        return;
+    }
+    // (Abandoning may run the collector, which may drop more Futures.)
+    queue->entries = 0;
+    queue->len = 0;
+    queue->capacity = 0;
+    for(j = 0; j < len; j += 2) {
+        session_abandon(session, entries[j]);
+    }
+    free(entries);
+}
+
+// Send the server whatever references are waiting to be released.  Must
+// be called with the session's write mutex held.  Servers older than
+// protocol version 2 do not understand RELEASE, so nothing is sent to them.
+static void session_send_releases(ROMP_Session * session) {
+    ROMP_Message message = { ROMP_RELEASE, 0, Qnil, 0, 0 };
+
+    if(session->version < 2 || session->releases->len == 0) {
+        return;
+    }
+    message.message_obj = release_queue_take(session->releases);
+    if(!NIL_P(message.message_obj)) {
+        send_message(session, &message);
     }
 }
 
@@ -538,37 +3852,264 @@ static void server_loop(ROMP_Session * session, VALUE resolve_server, int dbg) {
 // ----------------------------------------------------------------------------
 
 // We use this structure to pass data to our client functions by casting it
-// to a Ruby VALUE (see above note with Server_Info).
+// to a Ruby VALUE (see above note with Server_Info).  The mutex is held only
+// while a message is being written; replies are matched up with their
+// requests by request id, so any number of calls can be in flight at once.
+// (Servers older than protocol version 2 are the exception; see
+// client_call.)
+//
+// A Proxy_Object made from an Object_Reference the server returned holds
+// that reference (and any more it is handed for the same object); when the
+// proxy is collected, they are queued on the session's release queue.
 typedef struct {
     ROMP_Session * session;
     VALUE ruby_session;
     OBJECT_ID_T object_id;
-    VALUE message;
     VALUE mutex;
+    ROMP_Release_Queue * releases;  // 0 if the proxy holds no references
+    uint32_t references;
 } Proxy_Object;
 
+// A single call through a Proxy_Object.
+typedef struct {
+    Proxy_Object * obj;
+    ROMP_Message msg;
+    int sent;   // the request has gone out
+    int done;   // the last reply to the request has come back
+    long method_id; // the method id the request tells the server, or -1
+    long window;    // credit granted for a call with a block, or 0
+    long taken;     // values yielded since credit was last granted
+    int exclusive;  // the mutex is held until the call is over
+} Client_Call;
+
+static void client_call_init(
+        Client_Call * call,
+        Proxy_Object * obj,
+        MESSAGE_TYPE_T message_type,
+        VALUE message,
+        int want_reply) {
+
+    call->obj = obj;
+    call->msg.message_type = message_type;
+    call->msg.object_id = obj->object_id;
+    call->msg.message_obj = message;
+    call->msg.request_id = want_reply ? session_next_request_id(obj->session) : 0;
+    call->msg.promise_id = 0;
+    call->sent = 0;
+    call->done = 0;
+    call->method_id = -1;
+    call->window = 0;
+    call->taken = 0;
+    call->exclusive = 0;
+}
+
+// On sessions that intern method names, replace the name at the start of
+// a request with its id, or with [id, name] if the server may not have
+// been told the id yet.  A name only counts as told once a message telling
+// it has been written directly: a batched message may be overtaken by
+// other threads' messages.
+static void client_method_id(Client_Call * call) {
+    ROMP_Session * session = call->obj->session;
+    VALUE message = call->msg.message_obj;
+    VALUE name, method_id;
+    long id;
+
+    if(   session->version < 3
+       || TYPE(message) != T_ARRAY
+       || RARRAY_LEN(message) == 0
+       || !SYMBOL_P(name = RARRAY_PTR(message)[0])) {
+        return;
+    }
+
+    if(NIL_P(session->method_ids)) {
+        session->method_ids = rb_hash_new();
+    }
+    method_id = rb_hash_aref(session->method_ids, name);
+    if(NIL_P(method_id)) {
+        if(session->next_method_id == ROMP_MAX_METHODS) {
+            return;
+        }
+        method_id = INT2FIX(session->next_method_id++);
+        rb_hash_aset(session->method_ids, name, method_id);
+    }
+
+    id = FIX2LONG(method_id);
+    if(session->methods_sent[id / 8] & (1 << (id % 8))) {
+        rb_ary_store(message, 0, method_id);
+    } else {
+        rb_ary_store(message, 0, rb_assoc_new(method_id, name));
+        call->method_id = id;
+    }
+}
+
+// Messages go out in the order they are sent: anything held in the cork
+// is written before any other message (or a RELEASE, which could otherwise
+// overtake a message for an object it releases).
+static VALUE client_send_locked(VALUE ruby_call) {
+    Client_Call * call = (Client_Call *)(ruby_call);
+    ROMP_Session * session = call->obj->session;
+
+    if(session->releases->len != 0) {
+        session_flush_cork(session);
+        session_send_releases(session);
+    }
+    if(session->cork_limit != 0 && call->msg.message_type == ROMP_ONEWAY) {
+        session_cork_message(session, &call->msg);
+    } else {
+        session_flush_cork(session);
+        send_message(session, &call->msg);
+    }
+    if(call->method_id >= 0) {
+        session->methods_sent[call->method_id / 8] |= 1 << (call->method_id % 8);
+    }
+    return Qnil;
+}
+
+// Send the message for a call to the server.  The whole message is written
+// while holding the mutex, so messages from different threads do not
+// interleave on the wire.  If the calling thread is batching, the message
+// is only queued (see Client#batch).
+static void client_send(Client_Call * call) {
+    VALUE batch = session_batch(call->obj->session);
+
+    client_method_id(call);
+    if(call->exclusive) {
+        client_send_locked((VALUE)(call));
+    } else if(!NIL_P(batch)) {
+        batch_message(call->obj->session, batch, &call->msg);
+    } else {
+        ruby_lock(call->obj->mutex);
+        rb_ensure(
+            client_send_locked, (VALUE)(call),
+            ruby_unlock, call->obj->mutex);
+    }
+    call->sent = 1;
+}
+
+// Called before waiting for a reply: if the calling thread is batching,
+// the request we want an answer to may still be queued.
+static void client_flush(Proxy_Object * obj) {
+    session_flush_batch(obj->session, obj->mutex, 0);
+}
+
+// Send a CREDIT message for a call with a block.  It is written right
+// away even if the calling thread is batching, since the server may be
+// waiting for it.
+static void client_send_credit(Client_Call * call, OBJECT_ID_T what, long count) {
+    Client_Call credit;
+
+    client_call_init(&credit, call->obj, ROMP_CREDIT, LONG2NUM(count), 0);
+    credit.msg.object_id = what;
+    credit.msg.request_id = call->msg.request_id;
+    ruby_lock(call->obj->mutex);
+    rb_ensure(
+        client_send_locked, (VALUE)(&credit),
+        ruby_unlock, call->obj->mutex);
+}
+
+static VALUE client_cancel_stream(VALUE ruby_call) {
+    client_send_credit((Client_Call *)(ruby_call), ROMP_CREDIT_CANCEL, 0);
+    return Qnil;
+}
+
+// Yield a value from the server to the caller's block.  Once the block has
+// taken half the window, the server is granted that much more credit.
+static void client_yield(Client_Call * call, VALUE value) {
+    Proxy_Object * obj = call->obj;
+
+    rb_yield(msg_to_obj(value, obj->ruby_session, obj->mutex));
+    if(call->window > 0 && ++call->taken >= (call->window + 1) / 2) {
+        client_send_credit(call, ROMP_CREDIT_MORE, call->taken);
+        call->taken = 0;
+    }
+}
+
+// Called when a call is over, one way or another.  If the caller left
+// before the last reply arrived, tell the session to discard the rest, and
+// tell the server to stop streaming values to it.  The server is also told
+// if it was granted credit for a request that then failed to go out, so
+// that it does not keep the credit forever.  (The caller may be leaving
+// because of an exception, which a failure to tell the server should not
+// replace.)
+static VALUE client_call_finish(VALUE ruby_call) {
+    Client_Call * call = (Client_Call *)(ruby_call);
+    int status;
+
+    if(call->sent && !call->done) {
+        session_abandon(call->obj->session, call->msg.request_id);
+    }
+    if(call->window > 0 && !call->done) {
+        rb_protect(client_cancel_stream, ruby_call, &status);
+    }
+    if(call->exclusive) {
+        call->exclusive = 0;
+        ruby_unlock(call->obj->mutex);
+    }
+    return Qnil;
+}
+
+// Make a call that expects a reply with func, and finish it however func
+// leaves.  A server older than protocol version 2 sends every reply with
+// request id 0, so its replies can only be told apart by the order they
+// come in; a call to one holds the mutex from when its request is sent
+// until its last reply is in, so that calls never overlap.
+static VALUE client_call(Client_Call * call, VALUE (*func)(VALUE)) {
+    if(call->obj->session->version < 2) {
+        ruby_lock(call->obj->mutex);
+        call->exclusive = 1;
+    }
+    return rb_ensure(func, (VALUE)(call), client_call_finish, (VALUE)(call));
+}
+
+// Raise if what (asynchronous calls, or batches) cannot be used on the
+// session, since the server would not say which request a reply is for.
+static void client_check_overlap(ROMP_Session * session, const char * what) {
+    if(session->version < 2) {
+        rb_raise(
+            rb_eRuntimeError,
+            "%s need protocol version 2 or later (the server speaks version %d)",
+            what,
+            session->version);
+    }
+}
+
 // Send a request to the server, wait for a response, and perform an action
-// based on what that response was.  This is not thread-safe, so the caller
-// should perform any necessary locking
-static VALUE client_request(VALUE ruby_proxy_object) {
-    Proxy_Object * obj = (Proxy_Object *)(ruby_proxy_object);
-    ROMP_Message msg = {
-        rb_block_given_p() ? ROMP_REQUEST_BLOCK : ROMP_REQUEST,
-        obj->object_id,
-        obj->message
-    };
-    send_message(obj->session, &msg);
+// based on what that response was.
+static VALUE client_request(VALUE ruby_call) {
+    Client_Call * call = (Client_Call *)(ruby_call);
+    Proxy_Object * obj = call->obj;
+    REQUEST_ID_T request_id = call->msg.request_id;
+    ROMP_Message msg;
+    Client_Call reply;
+    long j;
+
+    if(   call->msg.message_type == ROMP_REQUEST_BLOCK
+       && obj->session->version >= 6
+       && obj->session->stream_window > 0) {
+        call->window = obj->session->stream_window;
+        client_send_credit(call, ROMP_CREDIT_OPEN, call->window);
+    }
+    client_send(call);
+    client_flush(obj);
 
     for(;;) {
-        get_message(obj->session, &msg);
+        session_wait_reply(obj->session, request_id, &msg);
         switch(msg.message_type) {
             case ROMP_RETVAL:
+                call->done = 1;
                 return msg_to_obj(msg.message_obj, obj->ruby_session, obj->mutex);
                 break;
             case ROMP_YIELD:
-                rb_yield(msg_to_obj(msg.message_obj, obj->ruby_session, obj->mutex));
+                client_yield(call, msg.message_obj);
+                break;
+            case ROMP_YIELD_BATCH:
+                Check_Type(msg.message_obj, T_ARRAY);
+                for(j = 0; j < RARRAY_LEN(msg.message_obj); ++j) {
+                    client_yield(call, RARRAY_PTR(msg.message_obj)[j]);
+                }
                 break;
             case ROMP_EXCEPTION: {
+                call->done = 1;
                 ruby_raise(
                     msg.message_obj,
                     ruby_exc_message(msg.message_obj),
@@ -577,7 +4118,14 @@ static VALUE client_request(VALUE ruby_proxy_object) {
                 break;
             }
             case ROMP_SYNC:
-                reply_sync(obj->session, NUM2INT(msg.message_obj));
+                // Answer the way reply_sync would, but under the mutex.
+                if(NUM2INT(msg.message_obj) == 0) {
+                    client_call_init(&reply, obj, ROMP_SYNC, Qnil, 0);
+                    reply.msg.object_id = 1;
+                    reply.msg.request_id = request_id;
+                    reply.exclusive = call->exclusive;
+                    client_send(&reply);
+                }
                 break;
             default:
                 rb_raise(rb_eRuntimeError, "Invalid msg type received");
@@ -585,102 +4133,567 @@ static VALUE client_request(VALUE ruby_proxy_object) {
     }
 }
 
-// Send a oneway message to the server.  This is not thread-safe, so the
-// caller should perform any necessary locking.
-static VALUE client_oneway(VALUE ruby_proxy_object) {
-    Proxy_Object * obj = (Proxy_Object *)(ruby_proxy_object);
-    ROMP_Message msg = {
-        ROMP_ONEWAY,
-        obj->object_id,
-        obj->message
-    };
-    send_message(obj->session, &msg);
+// Send a oneway message to the server.
+static VALUE client_oneway(VALUE ruby_call) {
+    client_send((Client_Call *)(ruby_call));
+    return Qnil;
+}
+
+// Send a oneway message to the server and request a message in response.
+static VALUE client_oneway_sync(VALUE ruby_call) {
+    Client_Call * call = (Client_Call *)(ruby_call);
+    client_send(call);
+    client_flush(call->obj);
+    session_wait_reply(call->obj->session, call->msg.request_id, &call->msg);
+    call->done = 1;
+    return Qnil;
+}
+
+// Synchronize with the server.
+static VALUE client_sync(VALUE ruby_call) {
+    Client_Call * call = (Client_Call *)(ruby_call);
+    client_send(call);
+    client_flush(call->obj);
+    wait_sync(call->obj->session, call->msg.request_id);
+    call->done = 1;
+    return Qnil;
+}
+
+#define ROMP_FUTURE_PENDING    0
+#define ROMP_FUTURE_VALUE      1
+#define ROMP_FUTURE_EXCEPTION  2
+#define ROMP_FUTURE_ABANDONED  3
+
+// The result of an asynchronous call.  The request is sent as soon as the
+// future is created, and the reply is picked up whenever somebody asks for
+// it; until then it waits in the session along with any other replies that
+// arrive first.  A future that is collected without being asked has its
+// request abandoned (see ROMP_Session).  Only one thread at a time waits for
+// the reply; any others wait on the session's reply_cond for it to be
+// stored in the future.
+typedef struct {
+    VALUE proxy;            // the Proxy_Object the call was made through
+    REQUEST_ID_T request_id;
+    int state;
+    int waiting;            // true while a thread is waiting for the reply
+    VALUE result;           // the return value or exception
+    ROMP_Release_Queue * dropped;
+} ROMP_Future;
+
+// Store the reply to an asynchronous call in its future.
+static void future_resolve(ROMP_Future * future, Proxy_Object * obj, ROMP_Message * msg) {
+    switch(msg->message_type) {
+        case ROMP_RETVAL:
+            future->result = msg_to_obj(msg->message_obj, obj->ruby_session, obj->mutex);
+            future->state = ROMP_FUTURE_VALUE;
+            break;
+        case ROMP_EXCEPTION:
+            rb_ary_concat(ruby_exc_backtrace(msg->message_obj), ruby_caller());
+            future->result = msg->message_obj;
+            future->state = ROMP_FUTURE_EXCEPTION;
+            break;
+        default:
+            rb_raise(rb_eRuntimeError, "Invalid msg type received");
+    }
+}
+
+// Arguments for future_receive and future_received, below.
+typedef struct {
+    ROMP_Future * future;
+    Proxy_Object * obj;
+} Future_Wait;
+
+static VALUE future_receive(VALUE ruby_wait) {
+    Future_Wait * wait = (Future_Wait *)(ruby_wait);
+    ROMP_Message msg;
+
+    client_flush(wait->obj);
+    session_wait_reply(wait->obj->session, wait->future->request_id, &msg);
+    future_resolve(wait->future, wait->obj, &msg);
+    return Qnil;
+}
+
+// Let the other threads waiting on the future see the result (or, if
+// waiting for it failed, take over).
+static VALUE future_received(VALUE ruby_wait) {
+    Future_Wait * wait = (Future_Wait *)(ruby_wait);
+    ROMP_Session * session = wait->obj->session;
+
+    if(NIL_P(session->reply_mutex)) {
+        wait->future->waiting = 0;
+        return Qnil;
+    }
+    ruby_lock(session->reply_mutex);
+    wait->future->waiting = 0;
+    rb_funcall(session->reply_cond, id_broadcast, 0);
+    ruby_unlock(session->reply_mutex);
+    return Qnil;
+}
+
+static VALUE future_wait_other(VALUE ruby_future) {
+    ROMP_Future * future = (ROMP_Future *)(ruby_future);
+    Proxy_Object * obj;
+    Data_Get_Struct(future->proxy, Proxy_Object, obj);
+
+    while(future->state == ROMP_FUTURE_PENDING && future->waiting) {
+        rb_funcall(
+            obj->session->reply_cond, id_wait, 1, obj->session->reply_mutex);
+    }
+    return Qnil;
+}
+
+// Wait for the reply to an asynchronous call, if it has not already come.
+static void future_wait(ROMP_Future * future, Proxy_Object * obj) {
+    Future_Wait wait;
+    VALUE mutex = obj->session->reply_mutex;
+
+    while(future->state == ROMP_FUTURE_PENDING) {
+        if(future->waiting && !NIL_P(mutex)) {
+            ruby_lock(mutex);
+            rb_ensure(future_wait_other, (VALUE)(future), ruby_unlock, mutex);
+            continue;
+        }
+        future->waiting = 1;
+        wait.future = future;
+        wait.obj = obj;
+        rb_ensure(future_receive, (VALUE)(&wait), future_received, (VALUE)(&wait));
+    }
+}
+
+// Pick up the reply to an asynchronous call if it has already arrived,
+// without waiting for it.  Returns true if the call is complete.
+static int future_poll(ROMP_Future * future, Proxy_Object * obj) {
+    ROMP_Message msg;
+
+    if(future->state == ROMP_FUTURE_PENDING && !future->waiting) {
+        client_flush(obj);
+    }
+    if(   future->state == ROMP_FUTURE_PENDING
+       && !future->waiting
+       && session_poll_reply(obj->session, future->request_id, &msg)) {
+        future_resolve(future, obj, &msg);
+    }
+    return future->state != ROMP_FUTURE_PENDING;
+}
+
+// ----------------------------------------------------------------------------
+// Ruby interface functions
+// ----------------------------------------------------------------------------
+
+static void ruby_session_mark(ROMP_Session * session) {
+    rb_gc_mark(session->io_object);
+    rb_gc_mark(session->replies);
+    rb_gc_mark(session->abandoned);
+    rb_gc_mark(session->reply_mutex);
+    rb_gc_mark(session->reply_cond);
+    rb_gc_mark(session->batches);
+    rb_gc_mark(session->promises);
+    rb_gc_mark(session->references);
+    rb_gc_mark(session->handed);
+    rb_gc_mark(session->proxies);
+    rb_gc_mark(session->method_ids);
+    rb_gc_mark(session->methods);
+    rb_gc_mark(session->credits);
+    rb_gc_mark(session->write_mutex);
+    rb_gc_mark(session->stream_mutex);
+    rb_gc_mark(session->stream_cond);
+    rb_gc_mark(session->cork_queue);
+    rb_gc_mark(session->yield_queue);
+}
+
+static void ruby_session_free(ROMP_Session * session) {
+    release_queue_unref(session->releases);
+    release_queue_unref(session->dropped);
+    xfree(session->output.buf.ptr);
+    xfree(session->input.buf.ptr);
+    xfree(session->cork.ptr);
+    free(session);
+}
+
+static VALUE ruby_session_new(VALUE self, VALUE io_object) {
+    ROMP_Session * session;
+    VALUE ruby_session;
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+#elif defined(HAVE_RUBY_IO_H)
+    rb_io_t * openfile;
+#else
+    OpenFile * openfile;
+    FILE * read_fp;
+    FILE * write_fp;
+#endif
+
+    if(!rb_obj_is_kind_of(io_object, rb_cIO)) {
+        rb_raise(rb_eTypeError, "Expecting an IO object");
+    } 
+    
+    ruby_session = Data_Make_Struct(
+        rb_cSession,
+        ROMP_Session,
+        (RUBY_DATA_FUNC)(ruby_session_mark),
+        (RUBY_DATA_FUNC)(ruby_session_free),
+        session);
+
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+    session->read_fd = rb_io_descriptor(io_object);
+    session->write_fd = rb_io_descriptor(rb_io_get_write_io(io_object));
+#elif defined(HAVE_RUBY_IO_H)
+    GetOpenFile(io_object, openfile);
+    session->read_fd = openfile->fd;
+    GetOpenFile(rb_io_get_write_io(io_object), openfile);
+    session->write_fd = openfile->fd;
+#else
+    GetOpenFile(io_object, openfile);
+    read_fp = GetReadFile(openfile);
+    write_fp = GetWriteFile(openfile);
+    session->read_fd = fileno(read_fp);
+    session->write_fd = fileno(write_fp);
+#endif
+    session->io_object = io_object;
+    session->nonblock = 0;
+    session_set_version(session, 1);
+    session->next_request_id = 1;
+    session->reading = 0;
+    session->reply_mutex = Qnil;
+    session->reply_cond = Qnil;
+    session->replies = rb_hash_new();
+    session->abandoned = rb_hash_new();
+    session->batches = rb_hash_new();
+    session->promises = Qnil;
+    session->references = Qnil;
+    session->handed = Qnil;
+    session->releases = release_queue_new();
+    session->dropped = release_queue_new();
+    session->partial = 0;
+    memset(&session->output, 0, sizeof(session->output));
+    memset(&session->input, 0, sizeof(session->input));
+    session->frame_limit = ROMP_FRAME_LIMIT;
+    session->dispatched = 0;
+    session->message_limit = ROMP_MESSAGE_LIMIT;
+    session->yield_batch = ROMP_YIELD_BATCH_SIZE;
+    session->yield_queue = Qnil;
+    session->proxies = Qnil;
+    session->method_ids = Qnil;
+    session->next_method_id = 0;
+    memset(session->methods_sent, 0, sizeof(session->methods_sent));
+    session->methods = Qnil;
+    session->stream_window = ROMP_STREAM_WINDOW;
+    session->page_size = ROMP_CURSOR_PAGE;
+    memset(&session->cork, 0, sizeof(session->cork));
+    session->cork_limit = 0;
+    session->cork_delay = 0;
+    session->cork_queue = Qnil;
+    session->credits = Qnil;
+    session->write_mutex = Qnil;
+    session->stream_mutex = Qnil;
+    session->stream_cond = Qnil;
+    session->parked = 0;
+    session->closed = 0;
+
+    return ruby_session;
+}
+
+static VALUE ruby_set_nonblock(VALUE self, VALUE nonblock) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    if(nonblock == Qtrue) {
+        session->nonblock = 1;
+    } else if(nonblock == Qfalse) {
+        session->nonblock = 0;
+    } else {
+        rb_raise(rb_eTypeError, "Expecting a boolean");
+    }
+    return Qnil;
+}
+
+static VALUE ruby_set_thread_safe(VALUE self, VALUE thread_safe) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    if(thread_safe == Qtrue) {
+        session->reply_mutex = rb_class_new_instance(
+            0, 0, rb_path2class("Mutex"));
+        session->reply_cond = rb_class_new_instance(
+            0, 0, rb_path2class("ConditionVariable"));
+    } else if(thread_safe == Qfalse) {
+        session->reply_mutex = Qnil;
+        session->reply_cond = Qnil;
+    } else {
+        rb_raise(rb_eTypeError, "Expecting a boolean");
+    }
+    return Qnil;
+}
+
+static VALUE ruby_session_add_reference(VALUE self, VALUE obj, VALUE handle) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    if(NIL_P(session->references)) {
+        session->references = rb_hash_new();
+    }
+    rb_hash_aset(session->references, rb_obj_id(obj), rb_assoc_new(obj, handle));
+    return Qnil;
+}
+
+static VALUE ruby_session_remove_reference(VALUE self, VALUE obj) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    if(!NIL_P(session->references)) {
+        rb_hash_delete(session->references, rb_obj_id(obj));
+    }
+    return Qnil;
+}
+
+static int session_handed_pair(VALUE handle, VALUE count, VALUE counts) {
+    rb_ary_push(counts, handle);
+    rb_ary_push(counts, count);
+    return ST_CONTINUE;
+}
+
+// Forget the references handed to the session's client, and return them
+// as a flat Array of handle, count pairs, like a RELEASE message.
+static VALUE ruby_session_handed_references(VALUE self) {
+    ROMP_Session * session;
+    VALUE handed, counts;
+    Data_Get_Struct(self, ROMP_Session, session);
+
+    handed = session->handed;
+    session->handed = Qnil;
+    counts = rb_ary_new();
+    if(!NIL_P(handed)) {
+        rb_hash_foreach(handed, session_handed_pair, counts);
+    }
+    return counts;
+}
+
+// Forget every object registered on the session's behalf, and return them
+// as [object, handle] pairs so the server can unregister them.
+static VALUE ruby_session_release_references(VALUE self) {
+    ROMP_Session * session;
+    VALUE references;
+    Data_Get_Struct(self, ROMP_Session, session);
+
+    references = session->references;
+    session->references = Qnil;
+    if(NIL_P(references)) {
+        return rb_ary_new();
+    }
+    return rb_funcall(references, id_values, 0);
+}
+
+// Called on the server once the session is closed: cancel its parked
+// calls, and wait for any of them that is writing to finish, so none
+// writes to the connection after it is closed.
+static VALUE ruby_session_cancel_streams(VALUE self) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+
+    session->closed = 1;
+    if(NIL_P(session->stream_mutex)) {
+        return Qnil;
+    }
+    ruby_lock(session->stream_mutex);
+    session->credits = Qnil;
+    rb_funcall(session->stream_cond, id_broadcast, 0);
+    ruby_unlock(session->stream_mutex);
+    ruby_lock(session->write_mutex);
+    ruby_unlock(session->write_mutex);
+    return Qnil;
+}
+
+// Close the session's connection, so the peer sees it go away.
+static VALUE ruby_session_close(VALUE self) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    rb_funcall(session->io_object, id_close, 0);
+    return Qnil;
+}
+
+static VALUE ruby_session_negotiate(VALUE self) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    return INT2NUM(session_negotiate(session));
+}
+
+static VALUE ruby_session_version(VALUE self) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    return INT2NUM(session->version);
+}
+
+static VALUE ruby_session_begin_batch(VALUE self) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    client_check_overlap(session, "Batches");
+    if(!NIL_P(session_batch(session))) {
+        return Qfalse;
+    }
+    rb_hash_aset(session->batches, rb_thread_current(), rb_str_new(0, 0));
+    return Qtrue;
+}
+
+static VALUE ruby_session_end_batch(VALUE self, VALUE mutex) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session_flush_batch(session, mutex, 1);
+    return Qnil;
+}
+
+// Trim the frame buffers of a client session that has gone quiet (see
+// frame_idle).  The caller must hold the write mutex, so nobody is
+// sending; the input buffer is only trimmed if nobody is reading either.
+static void session_idle(ROMP_Session * session) {
+    frame_idle(&session->output);
+    if(!NIL_P(session->reply_mutex)) {
+        ruby_lock(session->reply_mutex);
+    }
+    if(!session->reading && !session->partial) {
+        frame_idle(&session->input);
+    }
+    if(!NIL_P(session->reply_mutex)) {
+        ruby_unlock(session->reply_mutex);
+    }
+}
+
+static VALUE session_send_releases_locked(VALUE ruby_session) {
+    ROMP_Session * session;
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+    if(session->releases->len != 0) {
+        session_flush_cork(session);
+        session_send_releases(session);
+    }
+    session_idle(session);
+    return Qnil;
+}
+
+static VALUE ruby_session_send_releases(VALUE self, VALUE mutex) {
+    ruby_lock(mutex);
+    rb_ensure(session_send_releases_locked, self, ruby_unlock, mutex);
     return Qnil;
 }
 
-// Send a oneway message to the server and request a message in response.
-// This is not thread-safe, so the caller should perform any necessary
-// locking.
-static VALUE client_oneway_sync(VALUE ruby_proxy_object) {
-    Proxy_Object * obj = (Proxy_Object *)(ruby_proxy_object);
-    ROMP_Message msg = {
-        ROMP_ONEWAY_SYNC,
-        obj->object_id,
-        obj->message
-    };
-    send_message(obj->session, &msg);
-    get_message(obj->session, &msg);
+static VALUE ruby_session_set_cork(VALUE self, VALUE limit, VALUE delay) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->cork_limit = NIL_P(limit) ? 0 : NUM2ULONG(limit);
+    session->cork_delay = NUM2LONG(delay);
     return Qnil;
 }
 
-// Synchronize with the server.  This is not thread-safe, so the caller should
-// perform any necessary locking.
-static VALUE client_sync(VALUE ruby_proxy_object) {
-    Proxy_Object * obj = (Proxy_Object *)(ruby_proxy_object);
-    send_sync(obj->session);
-    wait_sync(obj->session);
+static VALUE ruby_session_set_cork_queue(VALUE self, VALUE queue) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->cork_queue = queue;
     return Qnil;
 }
 
-// ----------------------------------------------------------------------------
-// Ruby interface functions
-// ----------------------------------------------------------------------------
+static VALUE session_flush_cork_locked(VALUE ruby_session) {
+    ROMP_Session * session;
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+    session_flush_cork(session);
+    return Qnil;
+}
 
-static void ruby_session_mark(ROMP_Session * session) {
-    rb_gc_mark(session->io_object);
+static VALUE ruby_session_flush_cork(VALUE self, VALUE mutex) {
+    ruby_lock(mutex);
+    rb_ensure(session_flush_cork_locked, self, ruby_unlock, mutex);
+    return Qnil;
 }
 
-static VALUE ruby_session_new(VALUE self, VALUE io_object) {
+static VALUE ruby_session_set_frame_limit(VALUE self, VALUE limit) {
     ROMP_Session * session;
-    VALUE ruby_session;
-    OpenFile * openfile;
-    FILE * read_fp;
-    FILE * write_fp;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->frame_limit = NUM2ULONG(limit);
+    return Qnil;
+}
 
-    if(!rb_obj_is_kind_of(io_object, rb_cIO)) {
-        rb_raise(rb_eTypeError, "Expecting an IO object");
-    } 
-    
-    ruby_session = Data_Make_Struct(
-        rb_cSession,
-        ROMP_Session,
-        (RUBY_DATA_FUNC)(ruby_session_mark),
-        (RUBY_DATA_FUNC)(free),
-        session);
+static VALUE ruby_session_set_message_limit(VALUE self, VALUE limit) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    if(NUM2ULONG(limit) < ROMP_READAHEAD_SIZE) {
+        rb_raise(rb_eArgError, "Message limit must be at least %d", ROMP_READAHEAD_SIZE);
+    }
+    session->message_limit = NUM2ULONG(limit);
+    return Qnil;
+}
 
-    GetOpenFile(io_object, openfile);
-    read_fp = GetReadFile(openfile);
-    write_fp = GetWriteFile(openfile);
-    session->read_fd = fileno(read_fp);
-    session->write_fd = fileno(write_fp);
-    session->io_object = io_object;
-    session->nonblock = 0;
+static VALUE ruby_session_set_yield_batch(VALUE self, VALUE count) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->yield_batch = NUM2LONG(count);
+    return Qnil;
+}
 
-    return ruby_session;
+static VALUE ruby_session_set_yield_queue(VALUE self, VALUE queue) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->yield_queue = queue;
+    return Qnil;
 }
 
-static VALUE ruby_set_nonblock(VALUE self, VALUE nonblock) {
+// Send what is left of a batch of yielded values the Server's flusher
+// thread got from the yield queue (see server_start_batch).
+static VALUE ruby_session_flush_yields(VALUE self, VALUE yields, VALUE request_id) {
     ROMP_Session * session;
     Data_Get_Struct(self, ROMP_Session, session);
-    if(nonblock == Qtrue) {
-        session->nonblock = 1;
-    } else if(nonblock == Qfalse) {
-        session->nonblock = 0;
-    } else {
-        rb_raise(rb_eTypeError, "Expecting a boolean");
+    Check_Type(yields, T_ARRAY);
+    server_send_yields(session, yields, NUM2UINT(request_id));
+    return Qnil;
+}
+
+static VALUE ruby_session_set_stream_window(VALUE self, VALUE count) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->stream_window = NIL_P(count) ? 0 : NUM2LONG(count);
+    return Qnil;
+}
+
+static VALUE ruby_session_set_page_size(VALUE self, VALUE count) {
+    ROMP_Session * session;
+    Data_Get_Struct(self, ROMP_Session, session);
+    session->page_size = NUM2LONG(count);
+    if(session->page_size < 1) {
+        rb_raise(rb_eArgError, "Page size must be at least 1");
     }
     return Qnil;
 }
 
+static void frame_stats(VALUE stats, const char * name, const ROMP_Frame_Buffer * fb) {
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(rb_intern("capacity")), ULONG2NUM(fb->buf.capacity));
+    rb_hash_aset(h, ID2SYM(rb_intern("high_water")), ULONG2NUM(fb->high_water));
+    rb_hash_aset(h, ID2SYM(rb_intern("oversize")), ULONG2NUM(fb->oversize));
+    rb_hash_aset(stats, ID2SYM(rb_intern(name)), h);
+}
+
+static VALUE ruby_session_frame_stats(VALUE self) {
+    ROMP_Session * session;
+    VALUE stats = rb_hash_new();
+    Data_Get_Struct(self, ROMP_Session, session);
+    frame_stats(stats, "output", &session->output);
+    frame_stats(stats, "input", &session->input);
+    rb_hash_aset(
+        stats, ID2SYM(rb_intern("limit")), ULONG2NUM(session->frame_limit));
+    return stats;
+}
+
 static void ruby_proxy_object_mark(Proxy_Object * proxy_object) {
     rb_gc_mark(proxy_object->ruby_session);
     rb_gc_mark(proxy_object->mutex);
 }
 
+static void ruby_proxy_object_free(Proxy_Object * proxy_object) {
+    if(proxy_object->releases) {
+        release_queue_push(
+            proxy_object->releases,
+            proxy_object->object_id,
+            proxy_object->references);
+        release_queue_unref(proxy_object->releases);
+    }
+    free(proxy_object);
+}
+
 static VALUE ruby_proxy_object_new(
         VALUE self, VALUE ruby_session, VALUE ruby_mutex, VALUE ruby_object_id) {
     ROMP_Session * session;
-    OBJECT_ID_T object_id = NUM2INT(ruby_object_id);
+    OBJECT_ID_T object_id = NUM2UINT(ruby_object_id);
     Proxy_Object * proxy_object;
     VALUE ruby_proxy_object;
 
@@ -693,67 +4706,230 @@ static VALUE ruby_proxy_object_new(
         rb_cProxy_Object,
         Proxy_Object,
         (RUBY_DATA_FUNC)(ruby_proxy_object_mark),
-        (RUBY_DATA_FUNC)(free),
+        (RUBY_DATA_FUNC)(ruby_proxy_object_free),
         proxy_object);
     proxy_object->session = session;
     proxy_object->ruby_session = ruby_session;
     proxy_object->mutex = ruby_mutex;
     proxy_object->object_id = object_id;
+    proxy_object->releases = 0;
+    proxy_object->references = 0;
 
     return ruby_proxy_object;
 }
 
 static VALUE ruby_proxy_object_method_missing(VALUE self, VALUE message) {
     Proxy_Object * proxy_object;
+    Client_Call call;
     Data_Get_Struct(self, Proxy_Object, proxy_object);
 
-    proxy_object->message = message;
-    ruby_lock(proxy_object->mutex);
-    return rb_ensure(
-        client_request, (VALUE)(proxy_object),
-        ruby_unlock, proxy_object->mutex);
+    client_call_init(
+        &call,
+        proxy_object,
+        rb_block_given_p() ? ROMP_REQUEST_BLOCK : ROMP_REQUEST,
+        message,
+        1);
+    return client_call(&call, client_request);
 }
 
 static VALUE ruby_proxy_object_oneway(VALUE self, VALUE message) {
     Proxy_Object * proxy_object;
+    Client_Call call;
     Data_Get_Struct(self, Proxy_Object, proxy_object);
 
-    proxy_object->message = message;
-    ruby_lock(proxy_object->mutex);
-    rb_ensure(
-        client_oneway, (VALUE)(proxy_object),
-        ruby_unlock, proxy_object->mutex);
+    client_call_init(&call, proxy_object, ROMP_ONEWAY, message, 0);
+    client_oneway((VALUE)(&call));
     return Qnil;
 }
 
 static VALUE ruby_proxy_object_oneway_sync(VALUE self, VALUE message) {
     Proxy_Object * proxy_object;
+    Client_Call call;
     Data_Get_Struct(self, Proxy_Object, proxy_object);
 
-    proxy_object->message = message;
-    ruby_lock(proxy_object->mutex);
-    rb_ensure(
-        client_oneway_sync, (VALUE)(proxy_object),
-        ruby_unlock, proxy_object->mutex);
+    client_call_init(&call, proxy_object, ROMP_ONEWAY_SYNC, message, 1);
+    client_call(&call, client_oneway_sync);
     return Qnil;
 }
 
 static VALUE ruby_proxy_object_sync(VALUE self) {
     Proxy_Object * proxy_object;
+    Client_Call call;
     Data_Get_Struct(self, Proxy_Object, proxy_object);
 
-    ruby_lock(proxy_object->mutex);
-    rb_ensure(
-        client_sync, (VALUE)(proxy_object),
-        ruby_unlock, proxy_object->mutex);
+    client_call_init(&call, proxy_object, ROMP_SYNC, Qnil, 1);
+    call.msg.object_id = 0;
+    client_call(&call, client_sync);
+    return Qnil;
+}
+
+static void ruby_future_mark(ROMP_Future * future) {
+    rb_gc_mark(future->proxy);
+    rb_gc_mark(future->result);
+}
+
+static void ruby_future_free(ROMP_Future * future) {
+    if(future->dropped) {
+        if(future->state == ROMP_FUTURE_PENDING) {
+            release_queue_push(future->dropped, future->request_id, 0);
+        }
+        release_queue_unref(future->dropped);
+    }
+    free(future);
+}
+
+// Send an asynchronous call through a Proxy_Object and return a Future for
+// its result.  The call is made on the proxy's object, or, if promise_id is
+// not 0, on the remote object returned by that request.
+static VALUE ruby_future_new(VALUE ruby_proxy_object, VALUE message, REQUEST_ID_T promise_id) {
+    Proxy_Object * proxy_object;
+    Client_Call call;
+    ROMP_Future * future;
+    VALUE ruby_future;
+    Data_Get_Struct(ruby_proxy_object, Proxy_Object, proxy_object);
+
+    client_check_overlap(proxy_object->session, "Asynchronous calls");
+    ruby_future = Data_Make_Struct(
+        rb_cFuture,
+        ROMP_Future,
+        (RUBY_DATA_FUNC)(ruby_future_mark),
+        (RUBY_DATA_FUNC)(ruby_future_free),
+        future);
+    future->proxy = ruby_proxy_object;
+    future->state = ROMP_FUTURE_PENDING;
+    future->waiting = 0;
+    future->result = Qnil;
+    future->dropped = 0;
+
+    if(promise_id == 0) {
+        client_call_init(&call, proxy_object, ROMP_REQUEST, message, 1);
+    } else {
+        client_call_init(&call, proxy_object, ROMP_PIPELINE, message, 1);
+        call.msg.object_id = 0;
+        call.msg.promise_id = promise_id;
+    }
+    future->request_id = call.msg.request_id;
+    client_send(&call);
+    future->dropped = proxy_object->session->dropped;
+    ++future->dropped->refcount;
+
+    return ruby_future;
+}
+
+static VALUE ruby_proxy_object_async(VALUE self, VALUE message) {
+    return ruby_future_new(self, message, 0);
+}
+
+static VALUE ruby_future_wait(VALUE self) {
+    ROMP_Future * future;
+    Proxy_Object * proxy_object;
+    Data_Get_Struct(self, ROMP_Future, future);
+    Data_Get_Struct(future->proxy, Proxy_Object, proxy_object);
+
+    future_wait(future, proxy_object);
+    return self;
+}
+
+static VALUE ruby_future_value(VALUE self) {
+    ROMP_Future * future;
+    Data_Get_Struct(self, ROMP_Future, future);
+
+    ruby_future_wait(self);
+    if(future->state == ROMP_FUTURE_ABANDONED) {
+        rb_raise(rb_eRuntimeError, "The call was abandoned");
+    }
+    if(future->state == ROMP_FUTURE_EXCEPTION) {
+        ruby_raise(
+            future->result,
+            ruby_exc_message(future->result),
+            ruby_exc_backtrace(future->result));
+    }
+    return future->result;
+}
+
+// Call a method on the result of an asynchronous call without waiting for
+// it (promise pipelining).  Once the result is here, this is just an
+// ordinary asynchronous call on it.
+static VALUE ruby_future_async(VALUE self, VALUE message) {
+    ROMP_Future * future;
+    Data_Get_Struct(self, ROMP_Future, future);
+
+    if(   future->state == ROMP_FUTURE_VALUE
+       && CLASS_OF(future->result) == rb_cProxy_Object) {
+        return ruby_future_new(future->result, message, 0);
+    }
+    return ruby_future_new(future->proxy, message, future->request_id);
+}
+
+static VALUE future_abandon_locked(VALUE ruby_future) {
+    ROMP_Future * future = (ROMP_Future *)(ruby_future);
+    Proxy_Object * proxy_object;
+    Data_Get_Struct(future->proxy, Proxy_Object, proxy_object);
+
+    session_abandon(proxy_object->session, future->request_id);
+    future->state = ROMP_FUTURE_ABANDONED;
+    return Qnil;
+}
+
+// Throw away the reply to an asynchronous call that nobody will ask for.
+static VALUE ruby_future_abandon(VALUE self) {
+    ROMP_Future * future;
+    Proxy_Object * proxy_object;
+    VALUE mutex;
+    Data_Get_Struct(self, ROMP_Future, future);
+    Data_Get_Struct(future->proxy, Proxy_Object, proxy_object);
+
+    if(future->state != ROMP_FUTURE_PENDING || future->waiting) {
+        return Qnil;
+    }
+    mutex = proxy_object->session->reply_mutex;
+    if(NIL_P(mutex)) {
+        future_abandon_locked((VALUE)(future));
+    } else {
+        ruby_lock(mutex);
+        rb_ensure(future_abandon_locked, (VALUE)(future), ruby_unlock, mutex);
+    }
     return Qnil;
 }
 
+static VALUE ruby_future_ready_p(VALUE self) {
+    ROMP_Future * future;
+    Proxy_Object * proxy_object;
+    Data_Get_Struct(self, ROMP_Future, future);
+    Data_Get_Struct(future->proxy, Proxy_Object, proxy_object);
+
+    return future_poll(future, proxy_object) ? Qtrue : Qfalse;
+}
+
 static VALUE ruby_server_loop(VALUE self, VALUE ruby_session) {
     ROMP_Session * session;
     VALUE resolve_server;
     VALUE ruby_debug;
     int debug;
+    int refcount;
+
+    if(!rb_obj_is_kind_of(ruby_session, rb_cSession)) {
+        rb_raise(rb_eTypeError, "Excpecting a session");
+    }
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+
+    resolve_server = rb_iv_get(self, "@resolve_server");
+
+    ruby_debug = rb_iv_get(self, "@debug");
+    debug = (ruby_debug != Qfalse) && !NIL_P(ruby_debug);
+    refcount = RTEST(rb_iv_get(self, "@reference_counting"));
+    return server_loop(
+            session, resolve_server, debug, refcount, self, ruby_session)
+        ? Qtrue
+        : Qfalse;
+}
+
+static VALUE ruby_server_dispatch(VALUE self, VALUE ruby_session) {
+    ROMP_Session * session;
+    VALUE resolve_server;
+    VALUE ruby_debug;
+    int debug;
+    int refcount;
 
     if(!rb_obj_is_kind_of(ruby_session, rb_cSession)) {
         rb_raise(rb_eTypeError, "Excpecting a session");
@@ -764,21 +4940,298 @@ static VALUE ruby_server_loop(VALUE self, VALUE ruby_session) {
 
     ruby_debug = rb_iv_get(self, "@debug");
     debug = (ruby_debug != Qfalse) && !NIL_P(ruby_debug);
-    server_loop(session, resolve_server, debug);
+    refcount = RTEST(rb_iv_get(self, "@reference_counting"));
+    return server_dispatch(
+            session, resolve_server, debug, refcount, self, ruby_session)
+        ? Qtrue
+        : Qfalse;
+}
+
+static void ruby_handle_table_mark(ROMP_Handle_Table * table) {
+    uint32_t j;
+
+    rb_gc_mark(table->ids);
+    for(j = 0; j < table->num_slots; ++j) {
+        if(table->slots[j].obj != Qundef) {
+            rb_gc_mark(table->slots[j].obj);
+        }
+    }
+}
+
+static void ruby_handle_table_free(ROMP_Handle_Table * table) {
+    xfree(table->slots);
+    free(table);
+}
+
+static VALUE ruby_handle_table_new(VALUE self) {
+    ROMP_Handle_Table * table;
+    VALUE ruby_table;
+
+    ruby_table = Data_Make_Struct(
+        rb_cHandle_Table,
+        ROMP_Handle_Table,
+        (RUBY_DATA_FUNC)(ruby_handle_table_mark),
+        (RUBY_DATA_FUNC)(ruby_handle_table_free),
+        table);
+    table->slots = 0;
+    table->num_slots = 0;
+    table->capacity = 0;
+    table->free_head = ROMP_HANDLE_NONE;
+    table->free_tail = ROMP_HANDLE_NONE;
+    table->count = 0;
+    table->ids = rb_hash_new();
+
+    return ruby_table;
+}
+
+static VALUE ruby_handle_table_register(int argc, VALUE * argv, VALUE self) {
+    ROMP_Handle_Table * table;
+    VALUE obj, counted;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    rb_scan_args(argc, argv, "11", &obj, &counted);
+    return UINT2NUM(handle_register(table, obj, RTEST(counted)));
+}
+
+static VALUE ruby_handle_table_unregister(VALUE self, VALUE obj) {
+    ROMP_Handle_Table * table;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    return handle_unregister(table, obj) ? Qtrue : Qfalse;
+}
+
+static VALUE ruby_handle_table_unregister_scoped(
+        VALUE self, VALUE obj, VALUE handle) {
+
+    ROMP_Handle_Table * table;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    return handle_unregister_scoped(table, obj, NUM2UINT(handle)) ? Qtrue : Qfalse;
+}
+
+static VALUE ruby_handle_table_include(VALUE self, VALUE obj) {
+    ROMP_Handle_Table * table;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    return NIL_P(rb_hash_aref(table->ids, rb_obj_id(obj))) ? Qfalse : Qtrue;
+}
+
+static VALUE ruby_handle_table_get_object(int argc, VALUE * argv, VALUE self) {
+    ROMP_Handle_Table * table;
+    Handle_Slot * slot;
+    VALUE handle, any_generation;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    rb_scan_args(argc, argv, "11", &handle, &any_generation);
+
+    slot = handle_lookup(table, NUM2UINT(handle), RTEST(any_generation));
+    if(!slot) {
+        rb_raise(rb_eRuntimeError, "Unknown object id %lu", NUM2ULONG(handle));
+    }
+    return slot->obj;
+}
+
+static VALUE ruby_handle_table_retain(VALUE self, VALUE handle) {
+    ROMP_Handle_Table * table;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    handle_retain(table, NUM2UINT(handle));
+    return Qnil;
+}
+
+// counts is a flat Array of handle, count pairs, as sent in a RELEASE
+// message.
+static VALUE ruby_handle_table_release(VALUE self, VALUE counts) {
+    ROMP_Handle_Table * table;
+    long j;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+
+    Check_Type(counts, T_ARRAY);
+    for(j = 0; j + 1 < RARRAY_LEN(counts); j += 2) {
+        handle_release(
+            table,
+            NUM2UINT(RARRAY_PTR(counts)[j]),
+            NUM2UINT(RARRAY_PTR(counts)[j + 1]));
+    }
+    return Qnil;
+}
+
+static VALUE ruby_handle_table_size(VALUE self) {
+    ROMP_Handle_Table * table;
+    Data_Get_Struct(self, ROMP_Handle_Table, table);
+    return UINT2NUM(table->count);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void ruby_reactor_mark(ROMP_Reactor * reactor) {
+    rb_gc_mark(reactor->sessions);
+}
+
+static void ruby_reactor_free(ROMP_Reactor * reactor) {
+    close(reactor->epoll_fd);
+    free(reactor);
+}
+
+static VALUE ruby_reactor_new(VALUE self) {
+    ROMP_Reactor * reactor;
+    VALUE ruby_reactor;
+    int epoll_fd;
+
+    epoll_fd = epoll_create(ROMP_REACTOR_MAX_EVENTS);
+    if(epoll_fd == -1) {
+        rb_sys_fail("epoll_create");
+    }
+    fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+
+    ruby_reactor = Data_Make_Struct(
+        rb_cReactor,
+        ROMP_Reactor,
+        (RUBY_DATA_FUNC)(ruby_reactor_mark),
+        (RUBY_DATA_FUNC)(ruby_reactor_free),
+        reactor);
+    reactor->epoll_fd = epoll_fd;
+    reactor->sessions = rb_hash_new();
+    gettimeofday(&reactor->swept, 0);
+
+    return ruby_reactor;
+}
+
+static ROMP_Session * ruby_reactor_get_session(VALUE ruby_session) {
+    ROMP_Session * session;
+    if(!rb_obj_is_kind_of(ruby_session, rb_cSession)) {
+        rb_raise(rb_eTypeError, "Expecting a session");
+    }
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+    return session;
+}
+
+static VALUE ruby_reactor_add(VALUE self, VALUE ruby_session) {
+    ROMP_Reactor * reactor;
+    ROMP_Session * session = ruby_reactor_get_session(ruby_session);
+    Data_Get_Struct(self, ROMP_Reactor, reactor);
+
+    rb_hash_aset(reactor->sessions, INT2NUM(session->read_fd), ruby_session);
+    if(reactor_watch(reactor, session, EPOLL_CTL_ADD) == -1) {
+        rb_sys_fail("epoll_ctl");
+    }
+    return Qnil;
+}
+
+static VALUE ruby_reactor_rearm(VALUE self, VALUE ruby_session) {
+    ROMP_Reactor * reactor;
+    ROMP_Session * session = ruby_reactor_get_session(ruby_session);
+    Data_Get_Struct(self, ROMP_Reactor, reactor);
+
+    // (The reactor would not report a message that is already buffered.)
+    if(session_poll_message(session)) {
+        return Qtrue;
+    }
+    session->dispatched = 0;
+    if(reactor_watch(reactor, session, EPOLL_CTL_MOD) == -1) {
+        rb_sys_fail("epoll_ctl");
+    }
+    return Qfalse;
+}
+
+static VALUE ruby_reactor_remove(VALUE self, VALUE ruby_session) {
+    ROMP_Reactor * reactor;
+    ROMP_Session * session = ruby_reactor_get_session(ruby_session);
+    Data_Get_Struct(self, ROMP_Reactor, reactor);
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, session->read_fd, 0);
+    rb_hash_delete(reactor->sessions, INT2NUM(session->read_fd));
+    rb_funcall(session->io_object, id_close, 0);
     return Qnil;
 }
 
+static VALUE ruby_reactor_wait(VALUE self) {
+    ROMP_Reactor * reactor;
+    Data_Get_Struct(self, ROMP_Reactor, reactor);
+    return reactor_wait(reactor);
+}
+
+#else
+
+static VALUE ruby_reactor_new(VALUE self) {
+    rb_raise(rb_eNotImpError, "ROMP::Reactor requires epoll");
+    return Qnil;
+}
+
+#endif
+
+// Return the Proxy_Object for the remote object object_id: the one the
+// client already has for it, if any, or a new one.
+static VALUE session_proxy(VALUE ruby_session, VALUE mutex, VALUE object_id) {
+    ROMP_Session * session;
+    VALUE ruby_proxy_object = Qnil;
+
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+    if(NIL_P(session->proxies) && !NIL_P(rb_cWeak_Map)) {
+        session->proxies = rb_class_new_instance(0, 0, rb_cWeak_Map);
+    }
+    if(!NIL_P(session->proxies)) {
+        ruby_proxy_object = rb_funcall(session->proxies, id_aref, 1, object_id);
+    }
+    if(NIL_P(ruby_proxy_object)) {
+        ruby_proxy_object = ruby_proxy_object_new(
+            rb_cProxy_Object,
+            ruby_session,
+            mutex,
+            object_id);
+        if(!NIL_P(session->proxies)) {
+            rb_funcall(session->proxies, id_aset, 2, object_id, ruby_proxy_object);
+        }
+    }
+    return ruby_proxy_object;
+}
+
+// Return the Proxy_Object for an Object_Reference the server returned.  A
+// reference to an object the client already has a proxy for returns that
+// proxy.  The proxy holds the reference, and releases it when it is
+// collected.
+static VALUE reference_to_proxy(VALUE reference, VALUE ruby_session, VALUE mutex) {
+    ROMP_Session * session;
+    VALUE ruby_proxy_object;
+    Proxy_Object * proxy_object;
+
+    Data_Get_Struct(ruby_session, ROMP_Session, session);
+    ruby_proxy_object = session_proxy(
+        ruby_session, mutex, rb_funcall(reference, id_object_id, 0));
+
+    Data_Get_Struct(ruby_proxy_object, Proxy_Object, proxy_object);
+    if(session->version < 2) {
+        // (Servers older than version 2 cannot be sent RELEASE.)
+        return ruby_proxy_object;
+    }
+    if(!proxy_object->releases) {
+        proxy_object->releases = session->releases;
+        ++proxy_object->releases->refcount;
+    }
+    ++proxy_object->references;
+    return ruby_proxy_object;
+}
+
+// Return the Proxy_Object for an object the client looked up by name.  The
+// server hands out no reference for it, so the proxy holds none.
+static VALUE ruby_session_proxy(VALUE self, VALUE mutex, VALUE object_id) {
+    return session_proxy(self, mutex, object_id);
+}
+
 // Given a message, convert it into an object that can be returned.  This
 // function really only checks to see if an Object_Reference has been returned
 // from the server, and creates a new Proxy_Object if this is the case.
 // Otherwise, the original object is returned to the client.
-static VALUE msg_to_obj(VALUE message, VALUE session, VALUE mutex) {
-    if(CLASS_OF(message) == rb_cObject_Reference) {
-        return ruby_proxy_object_new(
-            rb_cProxy_Object,
-            session,
-            mutex,
-            rb_funcall(message, id_object_id, 0));
+// A Cursor_Reference becomes an Enumerator that fetches the values from the
+// cursor as they are needed; it holds the proxy for the cursor, so the
+// cursor is released once the Enumerator is gone.
+static VALUE msg_to_obj(VALUE message, VALUE ruby_session, VALUE mutex) {
+    ROMP_Session * session;
+
+    if(CLASS_OF(message) == rb_cCursor_Reference) {
+        Data_Get_Struct(ruby_session, ROMP_Session, session);
+        return rb_funcall(
+            rb_mROMP,
+            id_remote_enumerator,
+            2,
+            reference_to_proxy(message, ruby_session, mutex),
+            LONG2NUM(session->page_size));
+    } else if(CLASS_OF(message) == rb_cObject_Reference) {
+        return reference_to_proxy(message, ruby_session, mutex);
     } else {
         return message;
     }
@@ -794,17 +5247,51 @@ void Init_romp_helper() {
     rb_define_const(rb_cSession, "REQUEST_BLOCK", INT2NUM(ROMP_REQUEST_BLOCK));
     rb_define_const(rb_cSession, "ONEWAY", INT2NUM(ROMP_ONEWAY));
     rb_define_const(rb_cSession, "ONEWAY_SYNC", INT2NUM(ROMP_ONEWAY_SYNC));
+    rb_define_const(rb_cSession, "PIPELINE", INT2NUM(ROMP_PIPELINE));
     rb_define_const(rb_cSession, "RETVAL", INT2NUM(ROMP_RETVAL));
     rb_define_const(rb_cSession, "EXCEPTION", INT2NUM(ROMP_EXCEPTION));
     rb_define_const(rb_cSession, "YIELD", INT2NUM(ROMP_YIELD));
+    rb_define_const(rb_cSession, "YIELD_BATCH", INT2NUM(ROMP_YIELD_BATCH));
     rb_define_const(rb_cSession, "SYNC", INT2NUM(ROMP_SYNC));
     rb_define_const(rb_cSession, "NULL_MSG", INT2NUM(ROMP_NULL_MSG));
+    rb_define_const(rb_cSession, "HELLO", INT2NUM(ROMP_HELLO));
+    rb_define_const(rb_cSession, "RELEASE", INT2NUM(ROMP_RELEASE));
+    rb_define_const(rb_cSession, "CREDIT", INT2NUM(ROMP_CREDIT));
     rb_define_const(rb_cSession, "MSG_START", INT2NUM(ROMP_MSG_START));
-    rb_define_const(rb_cSession, "MAX_ID", INT2NUM(ROMP_MAX_ID));
+    rb_define_const(rb_cSession, "MSG_START_V2", INT2NUM(ROMP_MSG_START_V2));
+    rb_define_const(rb_cSession, "NATIVE", INT2NUM(ROMP_NATIVE));
+    rb_define_const(rb_cSession, "PROTOCOL_VERSION", INT2NUM(ROMP_PROTOCOL_VERSION));
+    rb_define_const(rb_cSession, "MAX_ID_V1", INT2NUM(ROMP_MAX_ID_V1));
+    rb_define_const(rb_cSession, "MAX_ID", ULONG2NUM(ROMP_HANDLE_MAX_SLOTS));
+    rb_define_const(rb_cSession, "YIELD_BATCH_USEC", INT2NUM(ROMP_YIELD_BATCH_USEC));
     rb_define_const(rb_cSession, "MAX_MSG_TYPE", INT2NUM(ROMP_MAX_MSG_TYPE));
 
     rb_define_singleton_method(rb_cSession, "new", ruby_session_new, 1);
     rb_define_method(rb_cSession, "set_nonblock", ruby_set_nonblock, 1);
+    rb_define_method(rb_cSession, "set_thread_safe", ruby_set_thread_safe, 1);
+    rb_define_method(rb_cSession, "negotiate", ruby_session_negotiate, 0);
+    rb_define_method(rb_cSession, "add_reference", ruby_session_add_reference, 2);
+    rb_define_method(rb_cSession, "remove_reference", ruby_session_remove_reference, 1);
+    rb_define_method(rb_cSession, "release_references", ruby_session_release_references, 0);
+    rb_define_method(rb_cSession, "handed_references", ruby_session_handed_references, 0);
+    rb_define_method(rb_cSession, "cancel_streams", ruby_session_cancel_streams, 0);
+    rb_define_method(rb_cSession, "close", ruby_session_close, 0);
+    rb_define_method(rb_cSession, "version", ruby_session_version, 0);
+    rb_define_method(rb_cSession, "begin_batch", ruby_session_begin_batch, 0);
+    rb_define_method(rb_cSession, "end_batch", ruby_session_end_batch, 1);
+    rb_define_method(rb_cSession, "send_releases", ruby_session_send_releases, 1);
+    rb_define_method(rb_cSession, "set_cork", ruby_session_set_cork, 2);
+    rb_define_method(rb_cSession, "set_cork_queue", ruby_session_set_cork_queue, 1);
+    rb_define_method(rb_cSession, "flush_cork", ruby_session_flush_cork, 1);
+    rb_define_method(rb_cSession, "set_frame_limit", ruby_session_set_frame_limit, 1);
+    rb_define_method(rb_cSession, "set_message_limit", ruby_session_set_message_limit, 1);
+    rb_define_method(rb_cSession, "frame_stats", ruby_session_frame_stats, 0);
+    rb_define_method(rb_cSession, "set_yield_batch", ruby_session_set_yield_batch, 1);
+    rb_define_method(rb_cSession, "set_yield_queue", ruby_session_set_yield_queue, 1);
+    rb_define_method(rb_cSession, "flush_yields", ruby_session_flush_yields, 2);
+    rb_define_method(rb_cSession, "set_stream_window", ruby_session_set_stream_window, 1);
+    rb_define_method(rb_cSession, "set_page_size", ruby_session_set_page_size, 1);
+    rb_define_method(rb_cSession, "proxy", ruby_session_proxy, 2);
 
     rb_cProxy_Object = rb_define_class_under(rb_mROMP, "Proxy_Object", rb_cObject);
     rb_define_singleton_method(rb_cProxy_Object, "new", ruby_proxy_object_new, 3);
@@ -812,11 +5299,41 @@ void Init_romp_helper() {
     rb_define_method(rb_cProxy_Object, "oneway", ruby_proxy_object_oneway, -2);
     rb_define_method(rb_cProxy_Object, "oneway_sync", ruby_proxy_object_oneway_sync, -2);
     rb_define_method(rb_cProxy_Object, "sync", ruby_proxy_object_sync, 0);
+    rb_define_method(rb_cProxy_Object, "async", ruby_proxy_object_async, -2);
+
+    rb_cFuture = rb_define_class_under(rb_mROMP, "Future", rb_cObject);
+    rb_define_method(rb_cFuture, "value", ruby_future_value, 0);
+    rb_define_method(rb_cFuture, "wait", ruby_future_wait, 0);
+    rb_define_method(rb_cFuture, "ready?", ruby_future_ready_p, 0);
+    rb_define_method(rb_cFuture, "abandon", ruby_future_abandon, 0);
+    rb_define_method(rb_cFuture, "async", ruby_future_async, -2);
 
     rb_cServer = rb_define_class_under(rb_mROMP, "Server", rb_cObject);
     rb_define_method(rb_cServer, "server_loop", ruby_server_loop, 1);
+    rb_define_method(rb_cServer, "server_dispatch", ruby_server_dispatch, 1);
+
+    rb_cReactor = rb_define_class_under(rb_mROMP, "Reactor", rb_cObject);
+    rb_define_singleton_method(rb_cReactor, "new", ruby_reactor_new, 0);
+#ifdef HAVE_SYS_EPOLL_H
+    rb_define_method(rb_cReactor, "add", ruby_reactor_add, 1);
+    rb_define_method(rb_cReactor, "rearm", ruby_reactor_rearm, 1);
+    rb_define_method(rb_cReactor, "remove", ruby_reactor_remove, 1);
+    rb_define_method(rb_cReactor, "wait", ruby_reactor_wait, 0);
+#endif
 
     rb_cObject_Reference = rb_define_class_under(rb_mROMP, "Object_Reference", rb_cObject);
+    rb_cCursor_Reference = rb_define_class_under(rb_mROMP, "Cursor_Reference", rb_cObject_Reference);
+
+    rb_cHandle_Table = rb_define_class_under(rb_mROMP, "Handle_Table", rb_cObject);
+    rb_define_singleton_method(rb_cHandle_Table, "new", ruby_handle_table_new, 0);
+    rb_define_method(rb_cHandle_Table, "register", ruby_handle_table_register, -1);
+    rb_define_method(rb_cHandle_Table, "unregister", ruby_handle_table_unregister, 1);
+    rb_define_method(rb_cHandle_Table, "unregister_scoped", ruby_handle_table_unregister_scoped, 2);
+    rb_define_method(rb_cHandle_Table, "include?", ruby_handle_table_include, 1);
+    rb_define_method(rb_cHandle_Table, "get_object", ruby_handle_table_get_object, -1);
+    rb_define_method(rb_cHandle_Table, "retain", ruby_handle_table_retain, 1);
+    rb_define_method(rb_cHandle_Table, "release", ruby_handle_table_release, 1);
+    rb_define_method(rb_cHandle_Table, "size", ruby_handle_table_size, 0);
 
     id_object_id = rb_intern("object_id");
 }
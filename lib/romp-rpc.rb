@@ -1,6 +1,7 @@
 require 'socket'
 require 'thread'
 require 'fcntl'
+require 'weakref'
 require 'romp_helper'
 
 ##
@@ -54,11 +55,70 @@ require 'romp_helper'
 # REQUEST_BLOCK    server      obj to talk to          [:method, *args]
 # ONEWAY           server      obj to talk to          [:method, *args]
 # ONEWAY_SYNC      server      obj to talk to          [:method, *args] 
+# PIPELINE         server      always 0                [:method, *args]
 # RETVAL           client      always 0                retval
 # EXCEPTION        client      always 0                $!
 # YIELD            client      always 0                [value, value, ...]
+# YIELD_BATCH      client      always 0                [yield, yield, ...]
 # SYNC             either      0=request, 1=response   nil
 # NULL_MSG         either      always 0                n/a
+# HELLO            either      always 0                protocol version
+# RELEASE          server      always 0                [obj_id, count, ...]
+# CREDIT           server      0=open, 1=more, 2=cancel  count
+# 
+# Each message also carries a request id.  The client gives every message
+# that expects a reply (all but ONEWAY) a new, non-zero id, and the server
+# sends the id back with each YIELD, YIELD_BATCH, RETVAL, EXCEPTION, SYNC or NULL_MSG it
+# sends in reply.  This lets any number of threads make calls over the same
+# connection at once; a server that predates request ids replies with id 0,
+# so over version 1 the client makes one call at a time, and asynchronous
+# calls and batches are refused.
+# 
+# A PIPELINE request is aimed not at an object id but at the remote object
+# returned by an earlier request, whose id it carries as well.  This lets
+# the client call methods on the result of a call before the result has
+# come back (see Future#async).  The server only remembers the results of
+# its most recent requests for this purpose.
+# 
+# Two versions of the message header exist.  Version 1 has a 16-bit data
+# length, so a message can be at most 64k long; version 2 has a 32-bit
+# length and a 32-bit obj_id.  Every connection starts out with version 1.
+# The client sends HELLO with the newest version it knows, and the server
+# replies with HELLO and the version both sides will use from then on.  A
+# server that does not know HELLO replies with an EXCEPTION instead, and
+# version 1 stays in use.
+# Version 3 uses the version 2 header, and lets the client send a small id
+# in place of the method name in [:method, *args].  The client makes up the
+# ids; the first time it uses one, it sends [id, :method] instead, and the
+# server remembers the name for the rest of the connection.
+# Version 4 can send the message data in a compact encoding of its own
+# instead of with Marshal, when it is made up only of nil, true, false,
+# Integers, Floats, Strings, Symbols, Arrays and Hashes; the NATIVE bit
+# (0x8000) is set in the msg_type of such messages.
+# Version 5 lets the server send several values yielded to a block at once
+# in a YIELD_BATCH, each of which the client yields in turn.
+# Version 6 lets the client limit how far a method called with a block can
+# get ahead of it.  Just before the REQUEST_BLOCK, it sends CREDIT (open)
+# with the same request id and the number of values it is willing to have
+# in flight; the server stops in the middle of the method once it has
+# yielded that many, until the client sends CREDIT (more) for the values it
+# has taken since.  While stopped, the server goes on serving any other
+# messages from the client.  A client that gives up on the call sends
+# CREDIT (cancel), and the method is stopped with an exception.
+# Version 7 lets a method called without a block return an Enumerator.  The
+# server keeps it behind a Cursor and returns a Cursor_Reference, which
+# the client turns into an Enumerator that calls fetch on the cursor for
+# the values as they are needed, a page at a time.
+# Only objects in the first 65536 slots of the server's handle table can
+# be used over version 1; a version 1 client is handed the slot's index as
+# the object's id, and instead of handing it a reference to any other
+# object, the server raises an exception.
+# 
+# A client tells the server with RELEASE how many of the references it was
+# handed it has since dropped, for each object.  It only sends RELEASE over
+# version 2 or later, and expects no reply.  A server with reference counting turned
+# on unregisters an object created with create_reference once every
+# reference to it has been released.
 # 
 # BUGS:
 # - On a 2.2 kernel, oneway calls without sync is very slow.
@@ -74,6 +134,11 @@ public
     # a new thread which processes requests, allowing the server to do other
     # things while it is doing processing for a distributed object.  This
     # means, though, that all objects used with ROMP must be thread-safe.
+    #
+    # By default each connection gets its own thread.  In reactor mode, a
+    # single thread watches every connection with epoll and hands sessions
+    # with complete requests to a fixed pool of worker threads, so a server
+    # with thousands of mostly-idle clients needs only a handful of threads.
     # 
     class Server
 
@@ -86,14 +151,47 @@ public
         # @param endpoint An endpoint for the server to listen on; should be specified in URI notation.
         # @param acceptor A proc object that can accept or reject connections; it should take a Socket as an argument and returns true or false.
         # @param debug Turns on debugging messages if enabled.
+        # @param options A hash of server options:
+        #   :reactor enables reactor mode, and :workers sets the number of
+        #   worker threads it uses (default 4).
+        #   :scoped_references makes references created while serving a
+        #   connection go away when the connection does.
+        #   :reference_counting makes references go away once the clients
+        #   they were handed to have dropped them.
+        #   :frame_limit caps the memory, in bytes, each connection keeps
+        #   for encoding and decoding messages (default 1MB); a connection
+        #   that goes quiet for a second gives most of it back.
+        #   :message_limit is the largest message, in bytes, a client may
+        #   send (default 64MB); the server stops serving a connection that
+        #   sends a larger one.
+        #   :yield_batch turns on batching of the values yielded to a
+        #   client's block: up to this many are sent together (default 1,
+        #   which sends each right away).  Values are held back until the
+        #   batch fills up, the method returns, or the first of them has
+        #   waited a couple of milliseconds (Session::YIELD_BATCH_USEC),
+        #   whether or not the method yields again in the meantime; only
+        #   turn it on if the server's methods yield in quick succession.
         # 
-        def initialize(endpoint, acceptor=nil, debug=false)
+        def initialize(endpoint, acceptor=nil, debug=false, options={})
             @mutex = Mutex.new
             @debug = debug
+            @scoped_references = options[:scoped_references]
+            @reference_counting = options[:reference_counting]
+            @scope_owners = {}
+            @frame_limit = options[:frame_limit]
+            @message_limit = options[:message_limit]
+            @yield_batch = options[:yield_batch]
             @resolve_server = Resolve_Server.new
             @resolve_obj = Resolve_Obj.new(@resolve_server)
             @resolve_server.register(@resolve_obj)
 
+            if options[:reactor] then
+                start_reactor(options[:workers] || 4)
+            end
+            if @yield_batch && @yield_batch > 1 then
+                start_yield_flusher
+            end
+
             @thread = Thread.new do
                 server = Generic_Server.new(endpoint)
                 while(socket = server.accept)
@@ -107,16 +205,14 @@ public
                     puts "Accepted the connection" if @debug
                     session = Session.new(socket)
                     session.set_nonblock(true)
-                    Thread.new(socket) do |socket|
-                        Thread.current.abort_on_exception = true
-                        begin
-                            # TODO: Send a sync message to the client so it
-                            # knows we are ready to receive data.
-                            server_loop(session)
-                        rescue Exception
-                            ROMP::print_exception($!) if @debug
-                        end
-                        puts "Connection closed" if @debug
+                    session.set_frame_limit(@frame_limit) if @frame_limit
+                    session.set_message_limit(@message_limit) if @message_limit
+                    session.set_yield_batch(@yield_batch) if @yield_batch
+                    session.set_yield_queue(@yield_queue) if @yield_queue
+                    if @reactor then
+                        @reactor.add(session)
+                    else
+                        serve(session)
                     end
                 end
             end
@@ -130,25 +226,41 @@ public
         #
         # @param obj The object to register.
         #
+        # With reference counting turned on, the object is unregistered again
+        # when the clients it has been returned to are done with it, so the
+        # reference must not be kept and returned again after that.  With
+        # scoped references, an object that was not registered already is
+        # unregistered when the connection it was registered for goes away
+        # (unless it has been bound to a name since).  At most
+        # Session::MAX_ID objects can be registered at once.
+        #
         # @return A new Object_Reference that should be returned to the client.
         #
         def create_reference(obj)
             @mutex.synchronize do
-                id = @resolve_server.register(obj)
+                session = Thread.current[:romp_session] if @scoped_references
+                scoped = session && !@resolve_server.registered?(obj)
+                id = @resolve_server.register(obj, @reference_counting)
+                if scoped then
+                    session.add_reference(obj, id)
+                    @scope_owners[obj.__id__] = session
+                end
                 Object_Reference.new(id) #return
             end
         end
 
         ##
-        # Find an object in linear time and unregister it. Be careful with
-        # this function, because the client may not know the object has
-        # gone away.
+        # Unregister an object.  Be careful with this function, because the
+        # client may not know the object has gone away; calls it makes on
+        # the object afterwards raise an exception.
         #
         # @param obj The object to unregister.
         #
         def delete_reference(obj)
             @mutex.synchronize do
                 @resolve_server.unregister(obj)
+                session = @scope_owners.delete(obj.__id__)
+                session.remove_reference(obj) if session
             end
             nil #return
         end
@@ -174,6 +286,144 @@ public
         end
 
     private
+        ##
+        # Release the counted references held by the client of a session
+        # that has gone away, and unregister every object whose reference
+        # was scoped to it.
+        #
+        # @param session The session that was closed.
+        #
+        def release_references(session)
+            @mutex.synchronize do
+                @resolve_server.release(session.handed_references)
+                session.release_references.each do |obj, id|
+                    if @scope_owners[obj.__id__].equal?(session) then
+                        @scope_owners.delete(obj.__id__)
+                    end
+                    @resolve_server.release_scoped(obj, id)
+                end
+            end
+        end
+
+        ##
+        # Start the thread that sends each batch of yielded values still
+        # waiting once Session::YIELD_BATCH_USEC have passed since its
+        # first value, so a method that stops yielding for a while does not
+        # hold back the values it has already yielded.
+        #
+        def start_yield_flusher
+            @yield_queue = Queue.new
+            delay = Session::YIELD_BATCH_USEC / 1000000.0
+            Thread.new do
+                Thread.current.abort_on_exception = true
+                while entry = @yield_queue.pop
+                    session, yields, request_id, started = entry
+                    wait = started + delay - Time.now.to_f
+                    sleep(wait) if wait > 0
+                    begin
+                        session.flush_yields(yields, request_id)
+                    rescue IOError, SystemCallError
+                        # The connection has gone away.
+                    end
+                end
+            end
+        end
+
+        ##
+        # Start a thread to serve a session with server_loop.  A thread
+        # whose session was handed on while it finished a streamed call
+        # (see park) stops once the call is over, since another thread
+        # took over the loop.  Otherwise the connection is closed once the
+        # loop ends, however it ends, so a client the server has stopped
+        # serving (e.g. for going over :message_limit) sees it go away
+        # instead of waiting for a reply forever.
+        #
+        # @param session The session to serve.
+        #
+        def serve(session)
+            Thread.new do
+                Thread.current.abort_on_exception = true
+                Thread.current[:romp_session] = session
+                begin
+                    # TODO: Send a sync message to the client so it
+                    # knows we are ready to receive data.
+                    next if server_loop(session)
+                rescue Exception
+                    ROMP::print_exception($!) if @debug
+                end
+                session.cancel_streams
+                session.close
+                release_references(session)
+                puts "Connection closed" if @debug
+            end
+        end
+
+        ##
+        # Start the reactor thread and its worker pool.  The reactor only
+        # reports a session once until it is rearmed, so each session is
+        # handled by at most one worker at a time and its requests are
+        # processed in order.
+        #
+        # @param num_workers The number of worker threads to dispatch requests with.
+        #
+        def start_reactor(num_workers)
+            @reactor = Reactor.new
+            @ready = Queue.new
+
+            @reactor_thread = Thread.new do
+                Thread.current.abort_on_exception = true
+                loop do
+                    @reactor.wait.each do |session|
+                        @ready.push(session)
+                    end
+                end
+            end
+
+            num_workers.times { start_worker }
+        end
+
+        ##
+        # Start a worker thread.  A worker whose session was handed on
+        # while it finished a streamed call (see park) stops once the call
+        # is over, since another worker took its place.
+        #
+        def start_worker
+            Thread.new do
+                Thread.current.abort_on_exception = true
+                while session = @ready.pop
+                    Thread.current[:romp_session] = session
+                    begin
+                        break if server_dispatch(session)
+                        @ready.push(session) if @reactor.rearm(session)
+                    rescue Exception
+                        ROMP::print_exception($!) if @debug
+                        session.cancel_streams
+                        @reactor.remove(session)
+                        release_references(session)
+                        puts "Connection closed" if @debug
+                    end
+                    Thread.current[:romp_session] = nil
+                end
+            end
+        end
+
+        ##
+        # Called from C when a streamed call has run out of credit.  The
+        # call waits for more on the current thread, so the session is
+        # handed to another one, which serves whatever else the client
+        # sends in the meantime, the credit included.
+        #
+        # @param session The session the call was made on.
+        #
+        def park(session)
+            if @reactor then
+                @ready.push(session) if @reactor.rearm(session)
+                start_worker
+            else
+                serve(session)
+            end
+        end
+
         if false then # the following functions are implemented in C:
 
         ##
@@ -183,9 +433,25 @@ public
         #
         # @param session The session to run the loop with.
         #
+        # @return true if another thread took over the loop while a
+        # streamed call waited for credit, false otherwise.
+        #
         def server_loop(session)
         end
 
+        ##
+        # The server_dispatch function is the reactor-mode counterpart to
+        # server_loop.  It processes the requests that have already arrived
+        # on a session and returns instead of waiting for more.
+        #
+        # @param session The session to process requests for.
+        #
+        # @return true if the session was handed to another worker while
+        # a streamed call waited for credit, false otherwise.
+        #
+        def server_dispatch(session)
+        end
+
         end # if false
     end
 
@@ -200,13 +466,69 @@ public
         #
         # @param endpoint The endpoint the server is listening on.
         # @param sync Specifies whether to synchronize between threads; turn this off to get a 20% performance boost.
+        # @param options A hash of client options:
+        #   :release_interval is how often, in seconds, remote objects this
+        #   client no longer uses are released in the background (default 1;
+        #   nil turns it off).  Without sync they are only released when the
+        #   next call is made.
+        #   :stream_window is the most values a method called with a block
+        #   may yield ahead of the block (default 1024; nil for no limit).
+        #   :page_size is the most values an Enumerator returned by the
+        #   server fetches at once (default 1024).
+        #   :frame_limit caps the memory, in bytes, the connection keeps for
+        #   encoding and decoding messages (default 1MB); with sync, most of
+        #   it is given back once the connection goes quiet.
+        #   :message_limit is the largest reply, in bytes, the server may
+        #   send (default 64MB).
+        #   :cork_limit turns on corking: oneway calls are held back and
+        #   written together once this many bytes have piled up, once the
+        #   first of them has waited :cork_delay microseconds (default
+        #   1000), or before any other call goes out.  With sync, a
+        #   background thread also writes them out after :cork_delay;
+        #   without it they wait for the next call, so call flush when done.
+        #   A corked oneway call is not on the wire until it is flushed.
+        #   Whatever is still corked is flushed by close, by a finalizer
+        #   when the client is garbage collected, and by an at_exit hook
+        #   when the process exits normally (not on exit! or a crash).
         #
-        def initialize(endpoint, sync=true)
+        def initialize(endpoint, sync=true, options={})
             @server = Generic_Client.new(endpoint)
             @session = Session.new(@server)
             @session.set_nonblock(true)
+            @session.set_thread_safe(sync)
+            if options[:frame_limit] then
+                @session.set_frame_limit(options[:frame_limit])
+            end
+            if options[:message_limit] then
+                @session.set_message_limit(options[:message_limit])
+            end
+            if options.has_key?(:stream_window) then
+                @session.set_stream_window(options[:stream_window])
+            end
+            if options[:page_size] then
+                @session.set_page_size(options[:page_size])
+            end
+            cork_delay = options.fetch(:cork_delay, 1000)
+            if options[:cork_limit] then
+                @session.set_cork(options[:cork_limit], cork_delay)
+            end
+            @session.negotiate
             @mutex = sync ? Mutex.new : Null_Mutex.new
             @resolve_obj = Proxy_Object.new(@session, @mutex, 0)
+
+            interval = options.fetch(:release_interval, 1)
+            if sync and interval then
+                @release_thread = Client.release_thread(
+                    WeakRef.new(@session), @mutex, interval)
+            end
+
+            if options[:cork_limit] then
+                Client.flush_at_exit(self, @session, @mutex)
+            end
+            if sync and options[:cork_limit] then
+                @flush_thread = Client.flush_thread(
+                    @session, @mutex, cork_delay / 1e6)
+            end
         end
 
         ##
@@ -215,14 +537,196 @@ public
         #
         # @param object_name The name of the object to resolve.
         #
-        # @return A Proxy_Object that can be used to make method calls on the object in the server.
+        # @return A Proxy_Object that can be used to make method calls on the object in the server; the same one every time for the same object, as long as it is in use.
         #
         def resolve(object_name)
-            @mutex.synchronize do
-                object_id = @resolve_obj.resolve(object_name)
-                return Proxy_Object.new(@session, @mutex, object_id)
+            object_id = @resolve_obj.resolve(object_name)
+            return @session.proxy(@mutex, object_id)
+        end
+
+        ##
+        # Return how much memory the connection's frame buffers use, to
+        # help pick a :frame_limit.
+        #
+        # @return A hash; see Session#frame_stats.
+        #
+        def frame_stats()
+            return @session.frame_stats
+        end
+
+        ##
+        # Write out any oneway calls held back by corking (see the
+        # :cork_limit option).
+        #
+        def flush()
+            @session.flush_cork(@mutex)
+        end
+
+        ##
+        # Write out any oneway calls held back by corking, then close the
+        # connection.  Calls made on the client's proxies afterwards fail.
+        #
+        def close()
+            begin
+                flush
+            ensure
+                @server.close
+            end
+        end
+
+        ##
+        # Make many calls with a single round trip.  Calls made with the
+        # Batch passed to the block (or with Proxy_Object#async) from
+        # inside the block are queued up and sent to the server with one
+        # write when the block exits.  Waiting for a reply inside the block
+        # sends whatever has been queued so far.  Servers that only speak
+        # protocol version 1 cannot be sent batches.
+        #
+        # If the block raises, the calls queued so far are still sent, but
+        # their replies are thrown away.
+        #
+        # @return An Array of Futures, one for each call made with the Batch, in order.  Exceptions are raised when the value of the corresponding Future is asked for.
+        #
+        def batch()
+            batch = Batch.new
+            started = @session.begin_batch
+            begin
+                yield batch
+            rescue Exception
+                batch.futures.each { |future| future.abandon }
+                raise
+            ensure
+                @session.end_batch(@mutex) if started
+            end
+            return batch.futures
+        end
+
+        ##
+        # Start a thread that sends the server the references released by
+        # proxies that have been garbage collected, and trims the session's
+        # frame buffers once it has gone quiet.  It only holds on to the
+        # session weakly (a block in an instance method would hold on to
+        # the client), so it goes away when the client does.
+        #
+        # @param session A WeakRef to the session to send releases on.
+        # @param mutex The mutex to hold while sending.
+        # @param interval The number of seconds to wait between releases.
+        #
+        # @return The new thread.
+        #
+        def self.release_thread(session, mutex, interval)
+            Thread.new do
+                begin
+                    loop do
+                        sleep interval
+                        session.send_releases(mutex)
+                    end
+                rescue Exception
+                    # The session has been collected or closed.
+                end
+            end
+        end
+
+        ##
+        # Start a thread that writes out oneway calls that corking has held
+        # back for longer than the delay.  It sleeps until a call goes into
+        # an empty cork, and stops once the session has been collected.
+        # Like release_thread, it only holds on to the session weakly.
+        # Errors other than the session going away end the thread with the
+        # error.
+        #
+        # @param session The session to flush.
+        # @param mutex The mutex to hold while flushing.
+        # @param delay The number of seconds a call may be held back.
+        #
+        # @return The new thread.
+        #
+        def self.flush_thread(session, mutex, delay)
+            corked = Queue.new
+            session.set_cork_queue(corked)
+            ObjectSpace.define_finalizer(session, Client.stopper(corked))
+            flush_loop(WeakRef.new(session), mutex, delay, corked)
+        end
+
+        def self.flush_loop(session, mutex, delay, corked)
+            Thread.new do
+                begin
+                    while corked.pop
+                        sleep delay
+                        session.flush_cork(mutex)
+                    end
+                rescue WeakRef::RefError, IOError, Errno::EPIPE, Errno::ECONNRESET, Errno::EBADF
+                    # The session has been collected or closed.
+                end
             end
         end
+
+        def self.stopper(queue)
+            proc { queue.push(nil) }
+        end
+
+        ##
+        # Make sure the oneway calls a corked client still holds back are
+        # written out when the client is collected, or when the process
+        # exits, whichever comes first.  The sessions waiting for the
+        # process to exit are only held weakly.
+        #
+        # @param client The client.
+        # @param session The client's session.
+        # @param mutex The mutex to hold while flushing.
+        #
+        def self.flush_at_exit(client, session, mutex)
+            ObjectSpace.define_finalizer(client, Client.finisher(session, mutex))
+            @corked ||= begin
+                at_exit { Client.flush_corked }
+                ObjectSpace::WeakMap.new
+            end
+            @corked[session] = mutex
+        end
+
+        def self.flush_corked
+            @corked.each do |session, mutex|
+                Client.finisher(session, mutex).call
+            end
+        end
+
+        # (Flushing fails if the connection is already closed, or if the
+        # collector ran while the mutex was held, in which case whoever
+        # holds it writes the calls out anyway.)
+        def self.finisher(session, mutex)
+            proc do
+                begin
+                    session.flush_cork(mutex)
+                rescue IOError, ThreadError, SystemCallError
+                end
+            end
+        end
+    end
+
+    ##
+    # A Batch is passed to the block given to Client#batch; it keeps track
+    # of the calls made with it.
+    #
+    class Batch
+        attr_reader :futures
+
+        def initialize()
+            @futures = []
+        end
+
+        ##
+        # Queue up a call to a method on a remote object.
+        #
+        # @param obj The Proxy_Object to call the method on.
+        # @param function The method to call.
+        #
+        # @return A Future for the result of the call.
+        #
+        def call(obj, function, *args)
+            future = obj.async(function, *args)
+            @futures << future
+            return future
+        end
     end
 
 private
@@ -279,10 +783,123 @@ private
         end
     end
 
+    ##
+    # A ROMP::Cursor_Reference is returned to the client in place of an
+    # Enumerator, for the Cursor the server keeps it in.  The client turns it
+    # into an Enumerator of its own (see ROMP.remote_enumerator).
+    #
+    class Cursor_Reference < Object_Reference
+    end
+
+    ##
+    # A ROMP::Cursor holds an Enumerator returned by a method on the server,
+    # and hands its values out to the client a page at a time.
+    #
+    class Cursor
+        def initialize(enum)
+            @enumeration = Enumeration.new(enum)
+            @thread = nil
+            @requests = nil
+            @replies = nil
+        end
+
+        ##
+        # Return the values of the Enumerator starting at offset.  Going
+        # through it in order is cheap; going back means starting over.
+        #
+        # @param offset The index of the first value to return.
+        # @param count The most values to return.
+        #
+        # @return An Array of up to count values; fewer means the end was reached.
+        #
+        def fetch(offset, count)
+            if not @requests and @thread and @thread != Thread.current then
+                start_thread
+            end
+
+            if @requests then
+                @requests.push([offset, count])
+                result = @replies.pop
+                raise result if Exception === result
+                return result
+            end
+
+            @thread = Thread.current
+            @enumeration.fetch(offset, count) #return
+        end
+
+    private
+        ##
+        # Enumerator#next runs the enumerator in a Fiber, which cannot be
+        # resumed from another thread.  Once calls come from more than one
+        # thread (as they do in reactor mode), the enumerator is started
+        # over in a thread of its own, which runs until the cursor is
+        # collected.
+        #
+        def start_thread
+            @requests = Queue.new
+            @replies = Queue.new
+            @enumeration.rewind
+            Cursor.enumeration_thread(@enumeration, @requests, @replies)
+            ObjectSpace.define_finalizer(self, Cursor.stopper(@requests))
+        end
+
+        def self.enumeration_thread(enumeration, requests, replies)
+            Thread.new do
+                while request = requests.pop
+                    begin
+                        replies.push(enumeration.fetch(*request))
+                    rescue Exception
+                        replies.push($!)
+                    end
+                end
+            end
+        end
+
+        def self.stopper(requests)
+            proc { requests.push(nil) }
+        end
+
+        ##
+        # Where a Cursor is in its Enumerator.
+        #
+        class Enumeration
+            def initialize(enum)
+                @enum = enum
+                @position = 0
+            end
+
+            def rewind()
+                @enum.rewind
+                @position = 0
+            end
+
+            def fetch(offset, count)
+                rewind if offset < @position
+
+                values = []
+                begin
+                    while @position < offset
+                        @enum.next
+                        @position += 1
+                    end
+                    while values.size < count
+                        values << @enum.next
+                        @position += 1
+                    end
+                rescue StopIteration
+                end
+                values #return
+            end
+        end
+    end
+
     ##
     # A ROMP::Object acts as a proxy; it forwards most methods to the server
     # for execution.  When you make calls to a ROMP server, you will be
-    # making the calls through a Proxy_Object.
+    # making the calls through a Proxy_Object.  On Ruby 2.7 and later, every
+    # reference a client is handed to the same remote object comes back as
+    # the same Proxy_Object for as long as that proxy is in use.
     #
     class Proxy_Object
 
@@ -321,6 +938,17 @@ private
         def sync()
         end
 
+        ##
+        # The async function sends a request to the server and returns right
+        # away with a Future for the result, so that several calls can be
+        # outstanding at once.  It raises if the server only speaks protocol
+        # version 1, which cannot tell the client which call a reply is for.
+        #
+        # @return A Future that will hold the return value of the call.
+        #
+        def async(function, *args)
+        end
+
         end # if false
 
         # Make sure certain methods get passed down the wire.
@@ -338,7 +966,7 @@ private
                 def #{method}(*args)
                     raise(NameError,
                         "undefined method `#{method}' for " +
-                        "\#<#{self.class}:#{self.id}>")
+                        "\#<#{self.class}:#{self.__id__}>")
                 end
             }
         end
@@ -382,45 +1010,72 @@ private
     #
     class Resolve_Server
         def initialize
-            @next_id = 0
-            @unused_ids = Array.new
-            @id_to_object = Hash.new
+            @handles = Handle_Table.new
             @name_to_id = Hash.new
+            @bound_ids = Hash.new(0) # id => number of names bound to it
         end
 
-        def register(obj)
-            if @next_id >= Session::MAX_ID then
-                if @unused_ids.size == 0 then
-                    raise "Object limit exceeded"
-                else
-                    id = @unused_ids.pop
-                end
-            end
-            @id_to_object[@next_id] = obj
-            old_id = @next_id
-            @next_id = @next_id.succ()
-            old_id #return
+        def register(obj, counted=false)
+            @handles.register(obj, counted) #return
         end
 
-        def get_object(object_id)
-            @id_to_object[object_id] #return
+        def get_object(object_id, any_generation=false)
+            @handles.get_object(object_id, any_generation) #return
         end
 
         def unregister(obj)
-            delete_obj_from_array_private(@id_to_object, obj)
+            @handles.unregister(obj)
+        end
+
+        def registered?(obj)
+            @handles.include?(obj) #return
+        end
+
+        ##
+        # Unregister an object scoped to a connection that has gone away,
+        # unless it has been bound to a name or registered again under
+        # another id since.
+        #
+        def release_scoped(obj, object_id)
+            return if @bound_ids.has_key?(object_id)
+            @handles.unregister_scoped(obj, object_id)
+        end
+
+        def retain(object_id)
+            @handles.retain(object_id)
+        end
+
+        def release(counts)
+            @handles.release(counts)
+        end
+
+        ##
+        # Register a Cursor for enum on behalf of the client it is returned
+        # to, which releases it when it is done with it.
+        #
+        # @return A Cursor_Reference to return to the client.
+        #
+        def create_cursor(enum)
+            id = register(Cursor.new(enum), true)
+            retain(id)
+            Cursor_Reference.new(id) #return
         end
 
         def bind(name, id)
+            unbind(name)
             @name_to_id[name] = id
+            @bound_ids[id] += 1
         end
 
-        def resolve(name)
-            @name_to_id[name] #return
+        def unbind(name)
+            return if not @name_to_id.has_key?(name)
+            id = @name_to_id.delete(name)
+            @bound_ids[id] -= 1
+            @bound_ids.delete(id) if @bound_ids[id] == 0
         end
 
-        def delete_obj_from_array_private(array, obj)
-            index = array.index(obj)
-            array[index] = nil unless index == nil
+        def resolve(name)
+            @name_to_id[name] #return
         end
     end
 
@@ -534,6 +1189,30 @@ private
         end
     end
 
+    ##
+    # Make an Enumerator that fetches its values from a Cursor on the
+    # server as they are needed.  Pages start out small, so taking the first
+    # few values is cheap, and double in size up to page_size.  The
+    # Enumerator holds the proxy for the cursor, so the server can release
+    # the cursor once the Enumerator is gone.
+    #
+    # @param cursor A Proxy_Object for the cursor.
+    # @param page_size The most values to fetch at once.
+    #
+    def self.remote_enumerator(cursor, page_size)
+        Enumerator.new do |yielder|
+            offset = 0
+            count = [16, page_size].min
+            loop do
+                values = cursor.fetch(offset, count)
+                values.each { |value| yielder << value }
+                break if values.size < count
+                offset += count
+                count = [count * 2, page_size].min
+            end
+        end
+    end
+
     if false then # the following classes are implemented in C:
 
     ##
@@ -541,8 +1220,155 @@ private
     # to use it directly.
     #
     class Session
+        ##
+        # Return how much memory the session's frame buffers use, as a
+        # hash: :limit is the frame limit, and :output and :input each
+        # give the :capacity the buffer has now, the :high_water mark of the
+        # largest frame it has held, and how many frames were over the
+        # limit (:oversize).
+        #
+        def frame_stats()
+        end
+
+        ##
+        # Return the Proxy_Object for a remote object, reusing the one
+        # already in use for it if there is one.  The proxy holds no
+        # reference to release (see Client#resolve).
+        #
+        def proxy(mutex, object_id)
+        end
+
+        ##
+        # Turn corking of oneway messages on (limit is a number of bytes)
+        # or off (limit is nil); see the :cork_limit option to Client.
+        #
+        def set_cork(limit, delay_usec)
+        end
+
+        ##
+        # Set a Queue to push true onto when a oneway message goes into an
+        # empty cork.
+        #
+        def set_cork_queue(queue)
+        end
+
+        ##
+        # Write out the oneway messages held back by corking, holding the
+        # given mutex while doing so.
+        #
+        def flush_cork(mutex)
+        end
+
+        ##
+        # On the server, cancel the streamed calls still waiting for
+        # credit on a session that has been closed, so that none of them
+        # writes to the connection afterwards.
+        #
+        def cancel_streams()
+        end
+
+        ##
+        # Close the session's connection.
+        #
+        def close()
+        end
+
+        ##
+        # On the server, send what is left of a batch of yielded values
+        # taken from the queue given to set_yield_queue.
+        #
+        def flush_yields(yields, request_id)
+        end
+    end
+
+    ##
+    # The Handle_Table class is defined in romp_helper.so.  It hands out
+    # the object ids used by Resolve_Server.  An id is only valid until its
+    # object is unregistered; the slot it names may be reused afterwards,
+    # under a new id, once every other free slot has been.  (Version 1
+    # clients are handed the slot's index alone, which get_object accepts
+    # with any_generation.)  At most Session::MAX_ID objects (2**20) can be
+    # registered at once; registering more raises.  Objects registered as
+    # counted keep a count of the references handed out for them, and are
+    # unregistered when every one has been released.  You should never have
+    # to use it directly.
+    #
+    class Handle_Table
+    end
+
+    ##
+    # The Future class is defined in romp_helper.so.  A Future is returned
+    # by Proxy_Object#async and holds the result of the call once the
+    # server has replied.  A Future that is dropped without being asked for
+    # its value has its reply thrown away.
+    #
+    class Future
+        ##
+        # Wait for the call to complete and return its return value, or
+        # raise the exception the server raised.  Any number of threads may
+        # ask for the value at once.
+        #
+        def value()
+        end
+
+        ##
+        # Wait for the call to complete without raising.
+        #
+        # @return self
+        #
+        def wait()
+        end
+
+        ##
+        # Throw away the reply to the call; its value can no longer be asked
+        # for.
+        #
+        def abandon()
+        end
+
+        ##
+        # Return true if the call has completed, without waiting; only what
+        # has already arrived from the server is looked at.
+        #
+        def ready?()
+        end
+
+        ##
+        # Call a method on the remote object this call will return, without
+        # waiting for it to return, e.g. obj.async(:bar).async(:i).value
+        # takes one round trip instead of two.
+        #
+        # @return A Future for the result of the new call.
+        #
+        def async(function, *args)
+        end
+    end
+
+    ##
+    # The Reactor class is defined in romp_helper.so.  It watches many
+    # sessions at once for a Server running in reactor mode.  You should
+    # never have to use it directly.
+    #
+    class Reactor
     end
 
     end # if false
 
+public
+
+    class Future
+        ##
+        # Wait for all of the given futures and return their values in
+        # order.  The calls were sent when the futures were created, so
+        # this costs one round trip, not one per future.
+        #
+        # @param futures The futures to wait for.
+        #
+        # @return An Array of return values.
+        #
+        def self.all(*futures)
+            return futures.flatten.map { |future| future.value }
+        end
+    end
+
 end